@@ -1,8 +1,54 @@
 #define _SCL_SECURE_NO_WARNINGS
 #include "LogWrapper.h"
+#ifdef WCHAR_TO_UTF8_BENCHMARK
+#include "utf8_transcode.hpp"
+#include <cstdio>
+
+// wstr_to_utf8buf lives in the compiled spdlog lib, which only this build needs
+#ifdef _DEBUG
+#pragma comment(lib, "spdlogd.lib")
+#else
+#pragma comment(lib, "spdlog.lib")
+#endif
+
+// spdlog's wstr_to_utf8buf against the vectorized transcoder used by WriteLogW
+static void BenchmarkWcharToUtf8(const char* name, const std::wstring& text)
+{
+	const int iterations = 1000000;
+	spdlog::memory_buf_t buf;
+
+	spdlog::stopwatch spdlogWatch;
+	for (int i = 0; i < iterations; ++i)
+	{
+		buf.clear();
+		spdlog::details::os::wstr_to_utf8buf(spdlog::wstring_view_t(text.data(), text.size()), buf);
+	}
+	double spdlogNs = spdlogWatch.elapsed().count() * 1e9 / iterations;
+	std::string expected(buf.data(), buf.size());
+
+	spdlog::stopwatch simdWatch;
+	for (int i = 0; i < iterations; ++i)
+	{
+		buf.clear();
+		spdlog::details::wstr_to_utf8(text.data(), text.size(), buf);
+	}
+	double simdNs = simdWatch.elapsed().count() * 1e9 / iterations;
+	bool same = expected == std::string(buf.data(), buf.size());
+
+	printf("%-8s %4zu chars  wstr_to_utf8buf %8.1f ns  wstr_to_utf8 %8.1f ns  %s\n", name, text.size(), spdlogNs, simdNs, same ? "ok" : "MISMATCH");
+}
+#endif // WCHAR_TO_UTF8_BENCHMARK
 
 int main()
 {
+#ifdef WCHAR_TO_UTF8_BENCHMARK
+	BenchmarkWcharToUtf8("ascii", L"[MainWindow] OnButtonClicked id=42 state=ready, refreshing the layout of the toolbar");
+	BenchmarkWcharToUtf8("latin", L"Gr\u00f6\u00dfe der Datei \u00fcberschritten, bitte erneut versuchen: \u00dcberpr\u00fcfung l\u00e4uft");
+	BenchmarkWcharToUtf8("cjk", L"\u6253\u5f00\u6587\u4ef6\u5931\u8d25\uff0c\u8bf7\u68c0\u67e5\u8def\u5f84 path=C:/data/config.json");
+	BenchmarkWcharToUtf8("short", L"ok");
+	return 0;
+#endif // WCHAR_TO_UTF8_BENCHMARK
+
 	LogPathItem item = { "DemoSpdlog",L"D:/spdlog.txt" };
 	LogWrapper::Init({ item });
 	while (true)
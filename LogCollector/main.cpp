@@ -0,0 +1,304 @@
+// LogCollector: drains the shared memory rings of every process that called
+// LogWrapper::Init(items, LogWrapper::Mode_Shared) into shared log files.
+// Start it before the worker processes and keep it running. It can be
+// restarted while workers run, they register their loggers again.
+
+#ifndef SPDLOG_WCHAR_TO_UTF8_SUPPORT
+#define SPDLOG_WCHAR_TO_UTF8_SUPPORT
+#endif
+
+#ifndef SPDLOG_WCHAR_FILENAMES
+#define SPDLOG_WCHAR_FILENAMES
+#endif
+
+#ifndef _SCL_SECURE_NO_WARNINGS
+#define _SCL_SECURE_NO_WARNINGS
+#endif
+
+#include "shm_ring.hpp"
+#include "compressed_rotating_file_sink.hpp"
+#include <spdlog/details/log_msg.h>
+#include <spdlog/details/os.h>
+
+#include <cstdio>
+#include <map>
+#include <vector>
+
+typedef spdlog::sinks::compressed_rotating_file_sink_st CollectorSink;
+
+struct RingState
+{
+	std::unique_ptr<spdlog::details::shm_ring> ring;
+	uint64_t reportedSkipped;
+	// records of loggers without an open log file, e.g. opened with a previous collector
+	uint64_t unrouted;
+	std::string lastLoggerName;
+	// logger names are only unique within one process, so routing is per ring
+	uint32_t ownerPid;
+	std::map<std::string, std::shared_ptr<CollectorSink>> sinksByLogger;
+};
+
+// forget the routing of the previous owner
+static void ResetRouting(RingState& state, uint32_t ownerPid)
+{
+	state.ownerPid = ownerPid;
+	state.sinksByLogger.clear();
+	state.lastLoggerName.clear();
+}
+
+static volatile bool g_running = true;
+
+static BOOL WINAPI ConsoleHandler(DWORD)
+{
+	g_running = false;
+	return TRUE;
+}
+
+// a failed write or rotation costs this record only, the collector keeps draining for every other process
+static void SinkLog(CollectorSink& sink, const spdlog::details::log_msg& msg)
+{
+	try
+	{
+		sink.log(msg);
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "LogCollector: %s\n", e.what());
+	}
+	catch (...)
+	{
+		fprintf(stderr, "LogCollector: unknown exception writing a record\n");
+	}
+}
+
+static void SinkFlush(CollectorSink& sink)
+{
+	try
+	{
+		sink.flush();
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "LogCollector: %s\n", e.what());
+	}
+	catch (...)
+	{
+		fprintf(stderr, "LogCollector: unknown exception flushing\n");
+	}
+}
+
+// false if the logger has no open log file
+static bool WriteRecord(const std::map<std::string, std::shared_ptr<CollectorSink>>& sinksByLogger, const spdlog::details::shm_record_header& record,
+	spdlog::string_view_t loggerName, spdlog::string_view_t payload)
+{
+	auto it = sinksByLogger.find(std::string(loggerName.data(), loggerName.size()));
+	if (it == sinksByLogger.end())
+	{
+		return false;
+	}
+
+	spdlog::log_clock::time_point time(std::chrono::duration_cast<spdlog::log_clock::duration>(std::chrono::nanoseconds(record.time)));
+	spdlog::details::log_msg msg(time, spdlog::source_loc{}, loggerName, static_cast<spdlog::level::level_enum>(record.level), payload);
+	msg.thread_id = static_cast<size_t>(record.thread_id);
+	SinkLog(*it->second, msg);
+	return true;
+}
+
+// a worker that crashed never releases its ring; free it once it is drained
+static void ReleaseIfOwnerExited(RingState& state)
+{
+	spdlog::details::shm_ring_header* header = state.ring->header();
+	uint32_t pid = header->owner_pid.load();
+	if (pid == 0)
+	{
+		// released by its owner, the next owner starts over
+		if (state.ownerPid != 0 && header->read_pos.load() == header->write_pos.load())
+		{
+			ResetRouting(state, 0);
+		}
+		return;
+	}
+	if (header->read_pos.load() != header->write_pos.load())
+	{
+		return;
+	}
+
+	// only free the ring when the owner is known to be gone. any other
+	// failure (e.g. access denied for an elevated worker) keeps it claimed,
+	// a second producer would corrupt the ring.
+	bool exited = false;
+	HANDLE process = ::OpenProcess(SYNCHRONIZE, FALSE, pid);
+	if (process == nullptr)
+	{
+		exited = ::GetLastError() == ERROR_INVALID_PARAMETER;
+	}
+	else
+	{
+		exited = ::WaitForSingleObject(process, 0) == WAIT_OBJECT_0;
+		::CloseHandle(process);
+	}
+
+	if (exited && header->owner_pid.compare_exchange_strong(pid, 0))
+	{
+		ResetRouting(state, 0);
+	}
+}
+
+int main()
+{
+	// same settings as LogWrapper::Init
+	const int rotated_max_size = 1024 * 1024 * 200;
+	const int rotated_max_files = 1;
+	const int compressed_max_files = 1;
+	const std::string pattern = "[%Y-%m-%d %T.%e] [%n] [%L] [%t] %v";
+
+	std::unique_ptr<spdlog::details::shm_collector_lock> collectorLock;
+	std::vector<RingState> rings;
+	try
+	{
+		collectorLock.reset(new spdlog::details::shm_collector_lock());
+		for (size_t index = 0; index < spdlog::details::shm_ring_count; ++index)
+		{
+			RingState state;
+			state.ring = spdlog::details::shm_ring::create(index);
+			state.reportedSkipped = 0;
+			state.unrouted = 0;
+			state.ownerPid = 0;
+			rings.push_back(std::move(state));
+		}
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "LogCollector: %s\n", e.what());
+		return 1;
+	}
+
+	::SetConsoleCtrlHandler(ConsoleHandler, TRUE);
+
+	// one sink per log file, shared by every process and logger writing to it
+	std::map<spdlog::filename_t, std::shared_ptr<CollectorSink>> sinksByFile;
+
+	auto lastOwnerCheck = std::chrono::steady_clock::now();
+	while (g_running)
+	{
+		bool checkOwners = std::chrono::steady_clock::now() - lastOwnerCheck > std::chrono::seconds(1);
+		if (checkOwners)
+		{
+			lastOwnerCheck = std::chrono::steady_clock::now();
+		}
+
+		size_t records = 0;
+		for (auto& state : rings)
+		{
+			records += state.ring->read_all([&](const spdlog::details::shm_record_header& record, spdlog::string_view_t loggerName, spdlog::string_view_t payload)
+			{
+				std::string name(loggerName.data(), loggerName.size());
+				if (record.type == spdlog::details::shm_record_type::open_logger)
+				{
+					// a ring is only claimed once empty, so the first record from a new owner is always an open
+					uint32_t ownerPid = static_cast<uint32_t>(record.thread_id);
+					if (ownerPid != state.ownerPid)
+					{
+						ResetRouting(state, ownerPid);
+					}
+					spdlog::filename_t fileName(reinterpret_cast<const spdlog::filename_t::value_type*>(payload.data()), payload.size() / sizeof(spdlog::filename_t::value_type));
+					auto& sink = sinksByFile[fileName];
+					if (!sink)
+					{
+						try
+						{
+							sink = std::make_shared<CollectorSink>(fileName, rotated_max_size, rotated_max_files, compressed_max_files);
+							sink->set_pattern(pattern);
+						}
+						catch (const std::exception& e)
+						{
+							fprintf(stderr, "LogCollector: %s\n", e.what());
+							sinksByFile.erase(fileName);
+							return;
+						}
+					}
+					state.sinksByLogger[name] = sink;
+					state.lastLoggerName = name;
+					return;
+				}
+
+				if (WriteRecord(state.sinksByLogger, record, loggerName, payload))
+				{
+					state.lastLoggerName = name;
+				}
+				else
+				{
+					++state.unrouted;
+				}
+			});
+
+			// reported once the ring has a logger to report to; the reported
+			// count lives in the ring so a restarted collector goes on from there
+			spdlog::details::shm_ring_header* header = state.ring->header();
+			uint64_t dropped = header->dropped.load();
+			uint64_t reportedDropped = header->reported_dropped.load();
+			if (dropped != reportedDropped || state.unrouted != 0)
+			{
+				auto it = state.sinksByLogger.find(state.lastLoggerName);
+				if (it != state.sinksByLogger.end())
+				{
+					std::string text = "LogCollector: pid " + std::to_string(header->owner_pid.load());
+					if (dropped != reportedDropped)
+					{
+						text += " dropped " + std::to_string(dropped - reportedDropped) + " messages, ring full";
+					}
+					if (state.unrouted != 0)
+					{
+						text += (dropped != reportedDropped ? "," : "");
+						text += " discarded " + std::to_string(state.unrouted) + " messages of loggers with no open log file";
+					}
+					spdlog::details::log_msg msg(spdlog::source_loc{}, state.lastLoggerName, spdlog::level::warn, text);
+					SinkLog(*it->second, msg);
+					header->reported_dropped.store(dropped);
+					state.unrouted = 0;
+				}
+			}
+
+			// malformed data, no telling which process or logger it belonged to
+			uint64_t skipped = state.ring->skipped_bytes();
+			if (skipped != state.reportedSkipped)
+			{
+				fprintf(stderr, "LogCollector: ring %u skipped %llu bytes of malformed records\n", static_cast<unsigned int>(&state - rings.data()),
+					static_cast<unsigned long long>(skipped - state.reportedSkipped));
+				state.reportedSkipped = skipped;
+			}
+
+			if (checkOwners)
+			{
+				ReleaseIfOwnerExited(state);
+			}
+		}
+
+		if (records == 0)
+		{
+			// idle: push what we have to disk and back off
+			for (auto& it : sinksByFile)
+			{
+				SinkFlush(*it.second);
+			}
+			spdlog::details::os::sleep_for_millis(5);
+		}
+	}
+
+	// last pass, whatever the workers left behind
+	for (auto& state : rings)
+	{
+		state.ring->read_all([&](const spdlog::details::shm_record_header& record, spdlog::string_view_t loggerName, spdlog::string_view_t payload)
+		{
+			if (record.type == spdlog::details::shm_record_type::log)
+			{
+				WriteRecord(state.sinksByLogger, record, loggerName, payload);
+			}
+		});
+	}
+	for (auto& it : sinksByFile)
+	{
+		SinkFlush(*it.second);
+	}
+	return 0;
+}
@@ -1,6 +1,10 @@
 #include "stdafx.h"
 #include "LogWrapper.h"
 #include "compressed_rotating_file_sink.hpp"
+#include "priority_async_logger.hpp"
+#include "shm_ring.hpp"
+#include "utf8_transcode.hpp"
+#include "log_site_registry.hpp"
 #include <spdlog/async.h>
 #include <fmt/chrono.h>
 
@@ -14,6 +18,94 @@ inline std::shared_ptr<spdlog::logger> GetLogger(const std::string& logName)
 	return logPtr.lock();
 }
 
+inline std::shared_ptr<spdlog::priority_thread_pool>& GetThreadPool()
+{
+	static std::shared_ptr<spdlog::priority_thread_pool> threadPool;
+	return threadPool;
+}
+
+inline std::shared_ptr<spdlog::details::shm_ring>& GetSharedRing()
+{
+	static std::shared_ptr<spdlog::details::shm_ring> sharedRing;
+	return sharedRing;
+}
+
+inline std::atomic<bool>& GetUseTsc()
+{
+	static std::atomic<bool> useTsc(false);
+	return useTsc;
+}
+
+inline void LogText(const std::shared_ptr<spdlog::logger>& logger, spdlog::level::level_enum lv, spdlog::string_view_t text)
+{
+	if (GetUseTsc().load(std::memory_order_relaxed))
+	{
+		auto priorityLogger = dynamic_cast<spdlog::priority_async_logger*>(logger.get());
+		if (priorityLogger)
+		{
+			priorityLogger->log_tsc(lv, text);
+			return;
+		}
+	}
+
+	logger->log(lv, text);
+}
+
+inline void LogText(const std::shared_ptr<spdlog::logger>& logger, spdlog::level::level_enum lv, const std::string& text)
+{
+	LogText(logger, lv, spdlog::string_view_t(text.data(), text.size()));
+}
+
+// transcode here instead of letting spdlog format a wide string
+inline void LogText(const std::shared_ptr<spdlog::logger>& logger, spdlog::level::level_enum lv, const std::wstring& text)
+{
+	spdlog::memory_buf_t buf;
+	spdlog::details::wstr_to_utf8(text.data(), text.size(), buf);
+	LogText(logger, lv, spdlog::string_view_t(buf.data(), buf.size()));
+}
+
+// the async backend resolves the site id, other loggers get the location right away
+inline void LogSiteText(const std::shared_ptr<spdlog::logger>& logger, unsigned int siteId, spdlog::level::level_enum lv, spdlog::string_view_t text)
+{
+	auto priorityLogger = dynamic_cast<spdlog::priority_async_logger*>(logger.get());
+	if (priorityLogger)
+	{
+		priorityLogger->log_site(lv, siteId, text, GetUseTsc().load(std::memory_order_relaxed));
+		return;
+	}
+
+	auto site = spdlog::details::log_site_registry::instance().find(siteId);
+	logger->log(site ? site->source() : spdlog::source_loc{}, lv, text);
+}
+
+// counts the hit and tells whether the site may log
+inline bool HitLogSite(unsigned int siteId)
+{
+	auto site = spdlog::details::log_site_registry::instance().find(siteId);
+	if (!site)
+	{
+		return true;
+	}
+
+	site->hits.fetch_add(1, std::memory_order_relaxed);
+	return site->enabled.load(std::memory_order_relaxed);
+}
+
+// "%*" prints "[file:line function] " for messages from the DEBUG_A ... CRITICAL_W macros
+inline void SetLogPattern()
+{
+	auto formatter = spdlog::details::make_unique<spdlog::pattern_formatter>();
+	formatter->add_flag<spdlog::log_site_formatter>('*').set_pattern("[%Y-%m-%d %T.%e] [%n] [%L] [%t] %*%v");
+	spdlog::set_formatter(std::move(formatter));
+}
+
+inline std::string ToUtf8(const std::wstring& text)
+{
+	spdlog::memory_buf_t buf;
+	spdlog::details::wstr_to_utf8(text.data(), text.size(), buf);
+	return std::string(buf.data(), buf.size());
+}
+
 inline spdlog::level::level_enum GetSpdLogLevel(LogWrapper::LogType type)
 {
 	spdlog::level::level_enum lv = spdlog::level::level_enum::n_levels;
@@ -40,6 +132,23 @@ inline spdlog::level::level_enum GetSpdLogLevel(LogWrapper::LogType type)
 	return lv;
 }
 
+inline LogWrapper::LogType GetLogType(spdlog::level::level_enum lv)
+{
+	switch (lv)
+	{
+	case spdlog::level::info:
+		return LogWrapper::Log_Desc;
+	case spdlog::level::warn:
+		return LogWrapper::Log_Warning;
+	case spdlog::level::err:
+		return LogWrapper::Log_Error;
+	case spdlog::level::critical:
+		return LogWrapper::Log_Critical;
+	default:
+		return LogWrapper::Log_Debug;
+	}
+}
+
 LOGWRAPPER_API void LogWrapper::Init(const std::vector<LogPathItem>& logPathItems)
 {
 	// 200MB
@@ -47,6 +156,47 @@ LOGWRAPPER_API void LogWrapper::Init(const std::vector<LogPathItem>& logPathItem
 	const int rotated_max_files = 1;
 	const int compressed_max_files = 1;
 
+	auto& threadPool = GetThreadPool();
+	if (!threadPool)
+	{
+		threadPool = std::make_shared<spdlog::priority_thread_pool>(spdlog::details::default_async_q_size);
+	}
+
+	for (auto it : logPathItems)
+	{
+		if (spdlog::get(it.first))
+		{
+			continue;
+		}
+		else
+		{
+			auto sink = std::make_shared<spdlog::sinks::compressed_rotating_file_sink_mt>(it.second, rotated_max_size, rotated_max_files, compressed_max_files);
+			auto logger = std::make_shared<spdlog::priority_async_logger>(it.first, std::move(sink), threadPool, spdlog::async_overflow_policy::overrun_oldest);
+			spdlog::initialize_logger(logger);
+		}
+	}
+	SetLogPattern();
+}
+
+LOGWRAPPER_API bool LogWrapper::Init(const std::vector<LogPathItem>& logPathItems, LogMode mode)
+{
+	if (mode != Mode_Shared)
+	{
+		Init(logPathItems);
+		return true;
+	}
+
+	auto& sharedRing = GetSharedRing();
+	if (!sharedRing)
+	{
+		sharedRing = spdlog::details::shm_ring::claim();
+	}
+	if (!sharedRing)
+	{
+		Init(logPathItems);
+		return false;
+	}
+
 	for (auto it : logPathItems)
 	{
 		if (spdlog::get(it.first))
@@ -55,15 +205,74 @@ LOGWRAPPER_API void LogWrapper::Init(const std::vector<LogPathItem>& logPathItem
 		}
 		else
 		{
-			spdlog::create_async_nb<spdlog::sinks::compressed_rotating_file_sink_mt>(it.first, it.second, rotated_max_size, rotated_max_files, compressed_max_files);
+			// synchronous: the ring write is the whole cost, the collector formats and writes the file
+			auto sink = std::make_shared<spdlog::sinks::shm_ring_sink_st>(sharedRing, it.first, it.second);
+			auto logger = std::make_shared<spdlog::logger>(it.first, std::move(sink));
+			spdlog::initialize_logger(logger);
 		}
 	}
-	spdlog::set_pattern("[%Y-%m-%d %T.%e] [%n] [%L] [%t] %v");
+	SetLogPattern();
+	return true;
 }
 
 LOGWRAPPER_API void LogWrapper::Uninit()
 {
+	GetUseTsc() = false;
 	spdlog::shutdown();
+	GetThreadPool().reset();
+	GetSharedRing().reset();
+}
+
+LOGWRAPPER_API LogWrapper::UninitResult LogWrapper::Uninit(const std::chrono::steady_clock::time_point& deadline)
+{
+	UninitResult result = { 0, 0 };
+	GetUseTsc() = false;
+
+	// rotations hit while draining must not compress inline
+	spdlog::apply_all([](std::shared_ptr<spdlog::logger> logger)
+	{
+		for (auto& sink : logger->sinks())
+		{
+			auto my_sink = dynamic_cast<spdlog::sinks::compressed_rotating_file_sink_mt*>(sink.get());
+			if (my_sink)
+			{
+				my_sink->defer_compression(true);
+			}
+		}
+	});
+
+	auto& threadPool = GetThreadPool();
+	if (threadPool)
+	{
+		spdlog::drain_result drained = threadPool->drain(deadline);
+		result.flushed = drained.flushed;
+		result.abandoned = drained.abandoned;
+	}
+
+	spdlog::shutdown();
+	threadPool.reset();
+	// records still in the shared ring are drained by the collector after we leave
+	GetSharedRing().reset();
+	return result;
+}
+
+LOGWRAPPER_API bool LogWrapper::SetTimeSource(TimeSource source)
+{
+	if (source != Time_Tsc)
+	{
+		GetUseTsc() = false;
+		return true;
+	}
+
+	auto& threadPool = GetThreadPool();
+	if (!threadPool || !threadPool->enable_tsc())
+	{
+		GetUseTsc() = false;
+		return false;
+	}
+
+	GetUseTsc() = true;
+	return true;
 }
 
 LOGWRAPPER_API void LogWrapper::SetDefaultLogger(const std::string& logName)
@@ -129,7 +338,7 @@ LOGWRAPPER_API void LogWrapper::WriteLogA(const std::string& logName, LogType ty
 	va_end(args);
 	text.resize((size_t)(len - 1));
 
-	logger->log(GetSpdLogLevel(type), "{}", text);
+	LogText(logger, GetSpdLogLevel(type), text);
 }
 
 LOGWRAPPER_API void LogWrapper::WriteLogA(const std::string& logName, LogType type, const char* log, va_list args)
@@ -152,7 +361,7 @@ LOGWRAPPER_API void LogWrapper::WriteLogA(const std::string& logName, LogType ty
 	vsprintf_s((char*)text.data(), (size_t)len, log, args);
 	text.resize(len - 1);
 
-	logger->log(GetSpdLogLevel(type), "{}", text);
+	LogText(logger, GetSpdLogLevel(type), text);
 }
 
 LOGWRAPPER_API void LogWrapper::WriteLogW(const std::string& logName, LogType type, const wchar_t* log, ...)
@@ -178,7 +387,7 @@ LOGWRAPPER_API void LogWrapper::WriteLogW(const std::string& logName, LogType ty
 	va_end(args);
 	text.resize(len - 1);
 
-	logger->log(GetSpdLogLevel(type), L"{}", text);
+	LogText(logger, GetSpdLogLevel(type), text);
 }
 
 LOGWRAPPER_API void LogWrapper::WriteLogW(const std::string& logName, LogType type, const wchar_t* log, va_list args)
@@ -202,7 +411,199 @@ LOGWRAPPER_API void LogWrapper::WriteLogW(const std::string& logName, LogType ty
 	va_end(args);
 	text.resize(len - 1);
 
-	logger->log(GetSpdLogLevel(type), L"{}", text);
+	LogText(logger, GetSpdLogLevel(type), text);
+}
+
+LOGWRAPPER_API void LogWrapper::WriteLogHex(const std::string& logName, LogType type, const char* label, const void* data, size_t len)
+{
+	auto logger = GetLogger(logName);
+	if (!logger)
+	{
+		return;
+	}
+
+	bool level_pass = logger->should_log(GetSpdLogLevel(type));
+	if (!level_pass)
+	{
+		return;
+	}
+
+	spdlog::string_view_t labelView(label ? label : "");
+	auto priorityLogger = dynamic_cast<spdlog::priority_async_logger*>(logger.get());
+	if (priorityLogger)
+	{
+		priorityLogger->log_hex(GetSpdLogLevel(type), labelView, data, len, GetUseTsc().load(std::memory_order_relaxed));
+		return;
+	}
+
+	spdlog::memory_buf_t text;
+	spdlog::details::format_hex_dump(labelView, data, len, len, text);
+	logger->log(GetSpdLogLevel(type), spdlog::string_view_t(text.data(), text.size()));
+}
+
+LOGWRAPPER_API void LogWrapper::SetHexLogLimit(const std::string& logName, size_t maxBytes)
+{
+	auto logger = GetLogger(logName);
+	if (!logger)
+	{
+		return;
+	}
+
+	auto priorityLogger = dynamic_cast<spdlog::priority_async_logger*>(logger.get());
+	if (priorityLogger)
+	{
+		priorityLogger->set_hex_limit(maxBytes);
+	}
+}
+
+LOGWRAPPER_API unsigned int LogWrapper::RegisterLogSite(const char* file, int line, const char* function, LogType type, const char* format)
+{
+	return spdlog::details::log_site_registry::instance().add(file ? file : "", line, function ? function : "", GetSpdLogLevel(type), format ? format : "");
+}
+
+LOGWRAPPER_API unsigned int LogWrapper::RegisterLogSite(const char* file, int line, const char* function, LogType type, const wchar_t* format)
+{
+	std::string formatA = ToUtf8(format ? format : L"");
+	return RegisterLogSite(file, line, function, type, formatA.c_str());
+}
+
+LOGWRAPPER_API void LogWrapper::WriteSiteLogA(unsigned int siteId, LogType type, const char* log, ...)
+{
+	if (!HitLogSite(siteId))
+	{
+		return;
+	}
+
+	auto logger = spdlog::default_logger();
+	if (!logger || !logger->should_log(GetSpdLogLevel(type)))
+	{
+		return;
+	}
+
+	va_list args;
+	va_start(args, log);
+	int len = _vscprintf(log, args) + 1;
+	std::string text;
+	text.resize((size_t)len);
+	vsprintf_s((char*)text.data(), (size_t)len, log, args);
+	va_end(args);
+	text.resize((size_t)(len - 1));
+
+	LogSiteText(logger, siteId, GetSpdLogLevel(type), spdlog::string_view_t(text.data(), text.size()));
+}
+
+LOGWRAPPER_API void LogWrapper::WriteSiteLogA(unsigned int siteId, LogType type, const char* log, va_list args)
+{
+	if (!HitLogSite(siteId))
+	{
+		return;
+	}
+
+	auto logger = spdlog::default_logger();
+	if (!logger || !logger->should_log(GetSpdLogLevel(type)))
+	{
+		return;
+	}
+
+	int len = _vscprintf(log, args) + 1;
+	std::string text;
+	text.resize((size_t)len);
+	vsprintf_s((char*)text.data(), (size_t)len, log, args);
+	text.resize((size_t)(len - 1));
+
+	LogSiteText(logger, siteId, GetSpdLogLevel(type), spdlog::string_view_t(text.data(), text.size()));
+}
+
+LOGWRAPPER_API void LogWrapper::WriteSiteLogW(unsigned int siteId, LogType type, const wchar_t* log, ...)
+{
+	if (!HitLogSite(siteId))
+	{
+		return;
+	}
+
+	auto logger = spdlog::default_logger();
+	if (!logger || !logger->should_log(GetSpdLogLevel(type)))
+	{
+		return;
+	}
+
+	va_list args;
+	va_start(args, log);
+	int len = _vscwprintf(log, args) + 1;
+	std::wstring text;
+	text.resize((size_t)len);
+	vswprintf_s((wchar_t*)text.data(), (size_t)len, log, args);
+	va_end(args);
+	text.resize(len - 1);
+
+	spdlog::memory_buf_t buf;
+	spdlog::details::wstr_to_utf8(text.data(), text.size(), buf);
+	LogSiteText(logger, siteId, GetSpdLogLevel(type), spdlog::string_view_t(buf.data(), buf.size()));
+}
+
+LOGWRAPPER_API void LogWrapper::WriteSiteLogW(unsigned int siteId, LogType type, const wchar_t* log, va_list args)
+{
+	if (!HitLogSite(siteId))
+	{
+		return;
+	}
+
+	auto logger = spdlog::default_logger();
+	if (!logger || !logger->should_log(GetSpdLogLevel(type)))
+	{
+		return;
+	}
+
+	int len = _vscwprintf(log, args) + 1;
+	std::wstring text;
+	text.resize((size_t)len);
+	vswprintf_s((wchar_t*)text.data(), (size_t)len, log, args);
+	text.resize(len - 1);
+
+	spdlog::memory_buf_t buf;
+	spdlog::details::wstr_to_utf8(text.data(), text.size(), buf);
+	LogSiteText(logger, siteId, GetSpdLogLevel(type), spdlog::string_view_t(buf.data(), buf.size()));
+}
+
+LOGWRAPPER_API void LogWrapper::EnableLogSite(unsigned int siteId, bool enable)
+{
+	auto site = spdlog::details::log_site_registry::instance().find(siteId);
+	if (site)
+	{
+		site->enabled = enable;
+	}
+}
+
+LOGWRAPPER_API std::vector<LogWrapper::LogSiteInfo> LogWrapper::GetLogSites()
+{
+	auto& registry = spdlog::details::log_site_registry::instance();
+	std::vector<LogSiteInfo> sites;
+	unsigned int count = registry.size();
+	sites.reserve(count);
+	for (unsigned int id = 1; id <= count; ++id)
+	{
+		auto site = registry.find(id);
+		LogSiteInfo info = { id, site->file, site->line, site->function, GetLogType(site->level), site->format, site->enabled.load(), site->hits.load() };
+		sites.push_back(std::move(info));
+	}
+	return sites;
+}
+
+LOGWRAPPER_API LogWrapper::QueueMemoryStats LogWrapper::GetQueueMemoryStats()
+{
+	QueueMemoryStats result = { 0, 0, 0, 0 };
+	auto& threadPool = GetThreadPool();
+	if (!threadPool)
+	{
+		return result;
+	}
+
+	spdlog::details::payload_slab_stats stats = threadPool->payload_stats();
+	result.reservedBytes = stats.reserved_bytes;
+	result.usedBytes = stats.in_use_bytes;
+	result.peakBytes = stats.peak_bytes;
+	result.heapFallbacks = stats.heap_fallbacks;
+	return result;
 }
 
 LOGWRAPPER_API std::wstring LogWrapper::GetLogPath(const std::string& logName)
@@ -226,7 +627,20 @@ LOGWRAPPER_API std::wstring LogWrapper::GetLogPath(const std::string& logName)
 	}
 
 	spdlog::sinks::compressed_rotating_file_sink_mt* my_sink = dynamic_cast<spdlog::sinks::compressed_rotating_file_sink_mt*>(sink_);
-	strLogPath = my_sink->filename();
+	if (my_sink)
+	{
+		strLogPath = my_sink->filename();
+		return strLogPath;
+	}
+
+	spdlog::sinks::shm_ring_sink_st* shm_sink = dynamic_cast<spdlog::sinks::shm_ring_sink_st*>(sink_);
+	if (shm_sink)
+	{
+		strLogPath = shm_sink->filename();
+		return strLogPath;
+	}
+
+	strLogPath.clear();
 	return strLogPath;
 }
 
@@ -242,9 +656,9 @@ public:
 
 	CStopWatcherImpl(const std::wstring& log)
 	{
+		m_logA = ToUtf8(log);
 		m_stopWatcher = spdlog::stopwatch();
 		m_logger = spdlog::default_logger();
-		m_logW = log;
 	}
 
 	CStopWatcherImpl(const std::string& logName, const std::string& log)
@@ -256,26 +670,24 @@ public:
 
 	CStopWatcherImpl(const std::string& logName, const std::wstring& log)
 	{
+		m_logA = ToUtf8(log);
 		m_stopWatcher = spdlog::stopwatch();
 		m_logger = spdlog::get(logName);
-		m_logW = log;
 	};
 
 	~CStopWatcherImpl()
 	{
 		if (m_logger)
 		{
+			// through LogText so the cycle counter time source applies here too
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(m_stopWatcher.elapsed());
 			if (!m_logA.empty())
 			{
-				m_logger->critical("{} Elapsed:{}", m_logA, std::chrono::duration_cast<std::chrono::milliseconds>(m_stopWatcher.elapsed()));
-			}
-			else if (!m_logW.empty())
-			{
-				m_logger->critical(L"{} Elapsed:{}", m_logW, std::chrono::duration_cast<std::chrono::milliseconds>(m_stopWatcher.elapsed()));
+				LogText(m_logger, spdlog::level::critical, fmt::format("{} Elapsed:{}", m_logA, elapsed));
 			}
 			else
 			{
-				m_logger->critical("Elapsed:{}", std::chrono::duration_cast<std::chrono::milliseconds>(m_stopWatcher.elapsed()));
+				LogText(m_logger, spdlog::level::critical, fmt::format("Elapsed:{}", elapsed));
 			}
 		}
 	};
@@ -284,7 +696,6 @@ private:
 	spdlog::stopwatch m_stopWatcher;
 	std::shared_ptr<spdlog::logger> m_logger;
 	std::string m_logA;
-	std::wstring m_logW;
 };
 
 LogWrapper::CStopWatcher::CStopWatcher(const std::string& log)
@@ -18,7 +18,9 @@
 #define _SCL_SECURE_NO_WARNINGS
 #endif
 
+#include <chrono>
 #include <memory>
+#include <string>
 #include <vector>
 #include <utility>
 #include <spdlog/spdlog.h>
@@ -38,8 +40,54 @@ namespace LogWrapper
 		Log_Critical,
 	};
 
+	enum LogMode
+	{
+		Mode_Process = 1,	// async pool and log files owned by this process
+		Mode_Shared,		// write into a shared memory ring drained by LogCollector.exe
+	};
+
+	enum TimeSource
+	{
+		Time_System = 1,	// clock read on the logging thread
+		Time_Tsc,			// cycle counter on the logging thread, converted to wall clock time by the async backend
+	};
+
+	struct UninitResult
+	{
+		size_t flushed;		// messages written while draining
+		size_t abandoned;	// messages dropped when the deadline passed
+	};
+
+	struct LogSiteInfo
+	{
+		unsigned int id;
+		std::string file;
+		int line;
+		std::string function;
+		LogType type;
+		std::string format;		// UTF-8
+		bool enabled;
+		unsigned long long hits;	// times the site was reached, including while disabled or below the log level
+	};
+
+	struct QueueMemoryStats
+	{
+		size_t reservedBytes;	// payload slabs allocated up front by Init
+		size_t usedBytes;		// slab bytes held by queued messages
+		size_t peakBytes;		// highest usedBytes so far
+		size_t heapFallbacks;	// messages that did not fit a free slab block and were copied to the heap
+	};
+
 	LOGWRAPPER_API void Init(const std::vector<LogPathItem>& logPathItems);
+	// returns false if Mode_Shared was requested but no collector ring could be claimed, the loggers then fall back to Mode_Process
+	LOGWRAPPER_API bool Init(const std::vector<LogPathItem>& logPathItems, LogMode mode);
 	LOGWRAPPER_API void Uninit();
+	// drain queued messages, most severe first, until deadline. pending compression is left to the next Init.
+	// the deadline is checked between messages, so a file write, rotation or compression already running when it
+	// passes is finished first and Uninit returns late by that much
+	LOGWRAPPER_API UninitResult Uninit(const std::chrono::steady_clock::time_point& deadline);
+	// call after Init. returns false if Time_Tsc is not usable (no invariant TSC or no async pool), Time_System stays in use
+	LOGWRAPPER_API bool SetTimeSource(TimeSource source);
 	LOGWRAPPER_API void SetDefaultLogger(const std::string& logName);
 	LOGWRAPPER_API std::string GetDefaultLoggerName();
 	LOGWRAPPER_API void SetLogLevel(const std::string& logName, LogType type);
@@ -48,7 +96,24 @@ namespace LogWrapper
 	LOGWRAPPER_API void WriteLogA(const std::string& logName, LogType type, const char* log, va_list args);
 	LOGWRAPPER_API void WriteLogW(const std::string& logName, LogType type, const wchar_t* log, ...);
 	LOGWRAPPER_API void WriteLogW(const std::string& logName, LogType type, const wchar_t* log, va_list args);
+	// logs "label (len bytes): <hex>", the bytes are hex encoded by the async backend
+	LOGWRAPPER_API void WriteLogHex(const std::string& logName, LogType type, const char* label, const void* data, size_t len);
+	// max bytes WriteLogHex keeps for an async logger, 0 for no limit
+	LOGWRAPPER_API void SetHexLogLimit(const std::string& logName, size_t maxBytes);
 	LOGWRAPPER_API std::wstring GetLogPath(const std::string& logName);
+	// call sites of the DEBUG_A ... CRITICAL_W macros, see below. ids start at 1, 0 if the registry is full
+	LOGWRAPPER_API unsigned int RegisterLogSite(const char* file, int line, const char* function, LogType type, const char* format);
+	LOGWRAPPER_API unsigned int RegisterLogSite(const char* file, int line, const char* function, LogType type, const wchar_t* format);
+	// log to the default logger, the async backend adds the source location of the site.
+	// Mode_Shared records carry only the text, so the collector writes them without the location
+	LOGWRAPPER_API void WriteSiteLogA(unsigned int siteId, LogType type, const char* log, ...);
+	LOGWRAPPER_API void WriteSiteLogA(unsigned int siteId, LogType type, const char* log, va_list args);
+	LOGWRAPPER_API void WriteSiteLogW(unsigned int siteId, LogType type, const wchar_t* log, ...);
+	LOGWRAPPER_API void WriteSiteLogW(unsigned int siteId, LogType type, const wchar_t* log, va_list args);
+	LOGWRAPPER_API void EnableLogSite(unsigned int siteId, bool enable);
+	LOGWRAPPER_API std::vector<LogSiteInfo> GetLogSites();
+	// payload memory of the async queue, all zero without an async pool (before Init, after Uninit, Mode_Shared)
+	LOGWRAPPER_API QueueMemoryStats GetQueueMemoryStats();
 
 	class CStopWatcherImpl;
 	class LOGWRAPPER_API CStopWatcher
@@ -64,13 +129,14 @@ namespace LogWrapper
 	};
 };
 
-#define DEBUG_A(fm,...) LogWrapper::WriteLogA(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Debug, fm, __VA_ARGS__);
-#define DEBUG_W(fm,...) LogWrapper::WriteLogW(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Debug, fm, __VA_ARGS__); 
-#define DESC_A(fm,...) LogWrapper::WriteLogA(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Desc, fm, __VA_ARGS__);
-#define DESC_W(fm,...) LogWrapper::WriteLogW(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Desc, fm, __VA_ARGS__);
-#define WARN_A(fm,...) LogWrapper::WriteLogA(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Warning, fm, __VA_ARGS__);
-#define WARN_W(fm,...) LogWrapper::WriteLogW(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Warning, fm, __VA_ARGS__);
-#define ERROR_A(fm,...) LogWrapper::WriteLogA(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Error, fm, __VA_ARGS__);
-#define ERROR_W(fm,...) LogWrapper::WriteLogW(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Error, fm, __VA_ARGS__);
-#define CRITICAL_A(fm,...) LogWrapper::WriteLogA(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Critical, fm, __VA_ARGS__);
-#define CRITICAL_W(fm,...) LogWrapper::WriteLogW(LogWrapper::GetDefaultLoggerName(), LogWrapper::Log_Critical, fm, __VA_ARGS__);
\ No newline at end of file
+// each expansion registers its call site once, messages then only carry the site id
+#define DEBUG_A(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Debug, fm); LogWrapper::WriteSiteLogA(logSiteId, LogWrapper::Log_Debug, fm, __VA_ARGS__); }
+#define DEBUG_W(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Debug, fm); LogWrapper::WriteSiteLogW(logSiteId, LogWrapper::Log_Debug, fm, __VA_ARGS__); }
+#define DESC_A(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Desc, fm); LogWrapper::WriteSiteLogA(logSiteId, LogWrapper::Log_Desc, fm, __VA_ARGS__); }
+#define DESC_W(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Desc, fm); LogWrapper::WriteSiteLogW(logSiteId, LogWrapper::Log_Desc, fm, __VA_ARGS__); }
+#define WARN_A(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Warning, fm); LogWrapper::WriteSiteLogA(logSiteId, LogWrapper::Log_Warning, fm, __VA_ARGS__); }
+#define WARN_W(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Warning, fm); LogWrapper::WriteSiteLogW(logSiteId, LogWrapper::Log_Warning, fm, __VA_ARGS__); }
+#define ERROR_A(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Error, fm); LogWrapper::WriteSiteLogA(logSiteId, LogWrapper::Log_Error, fm, __VA_ARGS__); }
+#define ERROR_W(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Error, fm); LogWrapper::WriteSiteLogW(logSiteId, LogWrapper::Log_Error, fm, __VA_ARGS__); }
+#define CRITICAL_A(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Critical, fm); LogWrapper::WriteSiteLogA(logSiteId, LogWrapper::Log_Critical, fm, __VA_ARGS__); }
+#define CRITICAL_W(fm,...) { static const unsigned int logSiteId = LogWrapper::RegisterLogSite(__FILE__, __LINE__, __FUNCTION__, LogWrapper::Log_Critical, fm); LogWrapper::WriteSiteLogW(logSiteId, LogWrapper::Log_Critical, fm, __VA_ARGS__); }
\ No newline at end of file
@@ -7,6 +7,7 @@
 
 #include <spdlog/details/os.h>
 
+#include <atomic>
 #include <chrono>
 #include <mutex>
 #include <string>
@@ -25,6 +26,13 @@ class compressed_rotating_file_sink final : public base_sink<Mutex> {
   static filename_t calc_filename(const filename_t& filename, std::size_t index);
   filename_t filename();
 
+  // While deferred, rotated files are left on disk uncompressed. They are
+  // picked up by the next compress pass, at the latest when the sink is
+  // constructed again by the next process start. A compression that is
+  // already running when deferral starts runs to completion.
+  void defer_compression(bool defer);
+  bool compression_deferred() const;
+
  protected:
   void sink_it_(const details::log_msg& msg) override;
   void flush_() override;
@@ -55,6 +63,9 @@ class compressed_rotating_file_sink final : public base_sink<Mutex> {
   filename_t dir_;
   filename_t basename_;
   filename_t file_ext_;
+  std::atomic<bool> compression_deferred_{false};
+  // reused for every message so long lines do not allocate once it has grown
+  memory_buf_t formatted_;
 };
 
 using compressed_rotating_file_sink_mt = compressed_rotating_file_sink<std::mutex>;
@@ -105,6 +116,15 @@ SPDLOG_INLINE compressed_rotating_file_sink<Mutex>::compressed_rotating_file_sin
 #endif
 		current_size_ = 0;
 	}
+	else if (max_compressed_files_ > 0 && details::os::path_exists(calc_filename(base_filename_, 1)))
+	{
+		// a previous process rotated the file but did not get to compress it
+#if defined(_WIN32) && defined(SPDLOG_WCHAR_FILENAMES)
+		compressW_();
+#else
+		compressA_();
+#endif
+	}
 }
 
 // calc filename according to index and file extension if exists.
@@ -129,9 +149,22 @@ SPDLOG_INLINE filename_t compressed_rotating_file_sink<Mutex>::filename()
 	return file_helper_.filename();
 }
 
+template<typename Mutex>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::defer_compression(bool defer)
+{
+	compression_deferred_ = defer;
+}
+
+template<typename Mutex>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex>::compression_deferred() const
+{
+	return compression_deferred_;
+}
+
 template <typename Mutex>
 SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::sink_it_(const details::log_msg& msg) {
-    memory_buf_t formatted;
+    memory_buf_t &formatted = formatted_;
+    formatted.clear();
     base_sink<Mutex>::formatter_->format(msg, formatted);
     auto new_size = current_size_ + formatted.size();
 
@@ -214,7 +247,7 @@ SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex>::rename_file_(const file
 template <typename Mutex>
 SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::compressW_()
 {
-	if (max_compressed_files_ == 0)
+	if (max_compressed_files_ == 0 || compression_deferred_)
 	{
 		return;
 	}
@@ -293,7 +326,11 @@ SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::compressW_()
 		std::string compress_target_fileA(buf.data(), buf.size());
 		buf.clear();
 
-		// compress file and remove file after success
+		// compress file and remove file after success.
+		// a compression already running is not interrupted by
+		// defer_compression(true). A compressor that can stop early should
+		// poll compression_deferred_ and keep the source file, the next start
+		// compresses it.
 		if (false)
 		{
 			details::os::remove(file_to_compress);
@@ -304,7 +341,7 @@ SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::compressW_()
 template <typename Mutex>
 SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::compressA_()
 {
-	if (max_compressed_files_ == 0)
+	if (max_compressed_files_ == 0 || compression_deferred_)
 	{
 		return;
 	}
@@ -375,7 +412,11 @@ SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::compressA_()
 	}
 	if (details::os::path_exists(file_to_compress))
 	{
-		// compress file and remove file after success
+		// compress file and remove file after success.
+		// a compression already running is not interrupted by
+		// defer_compression(true). A compressor that can stop early should
+		// poll compression_deferred_ and keep the source file, the next start
+		// compresses it.
 		if (false)
 		{
 			details::os::remove(file_to_compress);
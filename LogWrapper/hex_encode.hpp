@@ -0,0 +1,69 @@
+#pragma once
+
+// Hex encoding for WriteLogHex payloads, SSE2 with a scalar tail.
+
+#include <spdlog/common.h>
+
+#include <cstddef>
+#include <iterator>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define LOGWRAPPER_HAS_SSE2
+#endif
+
+namespace spdlog {
+namespace details {
+
+// append the lowercase hex encoding of data to dest
+inline void hex_encode(const void *data, std::size_t size, memory_buf_t &dest)
+{
+    const unsigned char *src = static_cast<const unsigned char *>(data);
+    std::size_t old_size = dest.size();
+    dest.resize(old_size + size * 2);
+    char *out = dest.data() + old_size;
+    std::size_t i = 0;
+
+#if defined(LOGWRAPPER_HAS_SSE2)
+    // nibble n -> '0' + n, plus ('a' - '0' - 10) when n > 9
+    const __m128i low_mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i digit_base = _mm_set1_epi8('0');
+    const __m128i alpha_offset = _mm_set1_epi8('a' - '0' - 10);
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), low_mask);
+        __m128i lo = _mm_and_si128(bytes, low_mask);
+        hi = _mm_add_epi8(_mm_add_epi8(hi, digit_base), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha_offset));
+        lo = _mm_add_epi8(_mm_add_epi8(lo, digit_base), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha_offset));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+
+    static const char digits[] = "0123456789abcdef";
+    for (; i < size; ++i)
+    {
+        out[i * 2] = digits[src[i] >> 4];
+        out[i * 2 + 1] = digits[src[i] & 0x0f];
+    }
+}
+
+// "<label> (<total_size> bytes): <hex>", with a note when only the first
+// size bytes were kept
+inline void format_hex_dump(string_view_t label, const void *data, std::size_t size, std::size_t total_size, memory_buf_t &dest)
+{
+    dest.append(label.data(), label.data() + label.size());
+    fmt::format_to(std::back_inserter(dest), " ({} bytes", total_size);
+    if (size < total_size)
+    {
+        fmt::format_to(std::back_inserter(dest), ", first {} shown", size);
+    }
+    string_view_t separator("): ");
+    dest.append(separator.data(), separator.data() + separator.size());
+    hex_encode(data, size, dest);
+}
+
+} // namespace details
+} // namespace spdlog
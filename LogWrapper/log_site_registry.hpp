@@ -0,0 +1,168 @@
+#pragma once
+
+// Call site registry for the DEBUG_A ... CRITICAL_W macros.
+//
+// Every macro expansion registers its file, line, function, level and format
+// string once, on first use, and afterwards only passes the returned id
+// along with the message. The async back thread looks the id up when the
+// message is written and fills in the source location, so queued records do
+// not grow with the location. Sites can be switched off one by one and
+// count how often they were hit.
+//
+// Sites are never removed. Lookups by id are lock free; registration takes a
+// mutex.
+
+#include <spdlog/common.h>
+#include <spdlog/pattern_formatter.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace spdlog {
+namespace details {
+
+struct log_site
+{
+    std::string file;
+    int line = 0;
+    std::string function;
+    level::level_enum level = level::off;
+    std::string format; // UTF-8
+    std::atomic<bool> enabled{true};
+    std::atomic<std::uint64_t> hits{0};
+
+    source_loc source() const
+    {
+        return source_loc{file.c_str(), line, function.c_str()};
+    }
+};
+
+class log_site_registry
+{
+public:
+    static const std::uint32_t invalid_id = 0;
+
+    static log_site_registry &instance()
+    {
+        static log_site_registry registry;
+        return registry;
+    }
+
+    log_site_registry(const log_site_registry &) = delete;
+    log_site_registry &operator=(const log_site_registry &) = delete;
+
+    // returns invalid_id once max_sites sites are registered
+    std::uint32_t add(string_view_t file, int line, string_view_t function, level::level_enum lvl, string_view_t format)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::uint32_t index = count_.load(std::memory_order_relaxed);
+        if (index >= max_sites)
+        {
+            return invalid_id;
+        }
+
+        std::unique_ptr<log_site[]> &chunk = chunks_[index / chunk_size];
+        if (!chunk)
+        {
+            chunk.reset(new log_site[chunk_size]);
+            published_chunks_[index / chunk_size].store(chunk.get(), std::memory_order_release);
+        }
+
+        log_site &site = chunk[index % chunk_size];
+        site.file.assign(file.data(), file.size());
+        site.line = line;
+        site.function.assign(function.data(), function.size());
+        site.level = lvl;
+        site.format.assign(format.data(), format.size());
+
+        // publish the site only once it is filled in
+        count_.store(index + 1, std::memory_order_release);
+        return index + 1;
+    }
+
+    // null for ids that were not handed out by add
+    log_site *find(std::uint32_t id)
+    {
+        if (id == invalid_id || id > count_.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+
+        std::uint32_t index = id - 1;
+        log_site *chunk = published_chunks_[index / chunk_size].load(std::memory_order_acquire);
+        return chunk + index % chunk_size;
+    }
+
+    std::uint32_t size() const
+    {
+        return count_.load(std::memory_order_acquire);
+    }
+
+private:
+    static const std::uint32_t chunk_size = 1024;
+    static const std::uint32_t max_chunks = 256;
+    static const std::uint32_t max_sites = chunk_size * max_chunks;
+
+    log_site_registry()
+    {
+        for (auto &chunk : published_chunks_)
+        {
+            chunk.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    std::mutex mutex_;
+    std::atomic<std::uint32_t> count_{0};
+    std::unique_ptr<log_site[]> chunks_[max_chunks];
+    std::atomic<log_site *> published_chunks_[max_chunks];
+};
+
+} // namespace details
+
+//
+// Pattern flag printing "[file:line function] " for messages that carry a
+// source location and nothing otherwise.
+//
+class log_site_formatter final : public custom_flag_formatter
+{
+public:
+    void format(const details::log_msg &msg, const std::tm &, memory_buf_t &dest) override
+    {
+        if (msg.source.empty())
+        {
+            return;
+        }
+
+        const char *file = msg.source.filename;
+        for (const char *pos = file; *pos != '\0'; ++pos)
+        {
+            if (*pos == '/' || *pos == '\\')
+            {
+                file = pos + 1;
+            }
+        }
+
+        dest.push_back('[');
+        dest.append(file, file + std::strlen(file));
+        fmt::format_to(std::back_inserter(dest), ":{}", msg.source.line);
+        if (msg.source.funcname != nullptr && *msg.source.funcname != '\0')
+        {
+            dest.push_back(' ');
+            dest.append(msg.source.funcname, msg.source.funcname + std::strlen(msg.source.funcname));
+        }
+        dest.push_back(']');
+        dest.push_back(' ');
+    }
+
+    std::unique_ptr<custom_flag_formatter> clone() const override
+    {
+        return details::make_unique<log_site_formatter>();
+    }
+};
+
+} // namespace spdlog
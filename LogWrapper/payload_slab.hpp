@@ -0,0 +1,189 @@
+#pragma once
+
+// Payload storage for queued async messages.
+//
+// Every queued message keeps its logger name, text and raw hex bytes in one
+// block taken from a set of size classed slabs. All slabs are carved out of a
+// single allocation made up front, so once the pool is running producers and
+// the back thread never call malloc for message payloads. A message larger
+// than the biggest class, or arriving while its class and every larger class
+// are exhausted, falls back to the heap; those allocations are counted in the
+// stats so the slab sizes can be tuned.
+//
+// Not thread safe - the owner must lock around it.
+
+#include <spdlog/common.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace spdlog {
+namespace details {
+
+struct payload_slab_stats
+{
+    std::size_t reserved_bytes = 0; // size of the slabs, fixed at construction
+    std::size_t in_use_bytes = 0;   // slab bytes held by queued messages
+    std::size_t peak_bytes = 0;     // highest in_use_bytes seen
+    std::size_t heap_fallbacks = 0; // payloads that did not fit a free slab block
+};
+
+// A block of payload memory. Slab blocks must be handed back with
+// payload_slab::release; heap blocks free themselves.
+class payload_block
+{
+    friend class payload_slab;
+
+public:
+    payload_block() = default;
+    payload_block(const payload_block &) = delete;
+    payload_block &operator=(const payload_block &) = delete;
+
+    // a moved from block is empty, so releasing it again is a no-op
+    payload_block(payload_block &&other) SPDLOG_NOEXCEPT
+        : data_(other.data_)
+        , size_class_(other.size_class_)
+        , index_(other.index_)
+        , heap_(std::move(other.heap_))
+    {
+        other.reset_();
+    }
+
+    payload_block &operator=(payload_block &&other) SPDLOG_NOEXCEPT
+    {
+        if (this != &other)
+        {
+            data_ = other.data_;
+            size_class_ = other.size_class_;
+            index_ = other.index_;
+            heap_ = std::move(other.heap_);
+            other.reset_();
+        }
+        return *this;
+    }
+
+    char *data() const
+    {
+        return data_;
+    }
+
+private:
+    static const std::uint32_t no_class = static_cast<std::uint32_t>(-1);
+
+    void reset_()
+    {
+        data_ = nullptr;
+        size_class_ = no_class;
+        index_ = 0;
+        heap_.reset();
+    }
+
+    char *data_ = nullptr;
+    std::uint32_t size_class_ = no_class;
+    std::uint32_t index_ = 0;
+    std::unique_ptr<char[]> heap_;
+};
+
+class payload_slab
+{
+public:
+    static const std::size_t classes_n = 5;
+
+    // reserves blocks for a queue of q_max_items messages: one small block
+    // per slot and fewer, larger blocks for long messages and stack dumps
+    explicit payload_slab(std::size_t q_max_items)
+    {
+        static const std::size_t block_sizes[classes_n] = {256, 1024, 4 * 1024, 16 * 1024, 64 * 1024};
+        static const std::size_t slots_per_block[classes_n] = {1, 8, 32, 128, 512};
+
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < classes_n; ++i)
+        {
+            size_class &cls = classes_[i];
+            cls.block_size = block_sizes[i];
+            cls.offset = total;
+            std::size_t blocks = q_max_items / slots_per_block[i];
+            cls.free_blocks.reserve(blocks > 0 ? blocks : 1);
+            for (std::size_t block = blocks > 0 ? blocks : 1; block > 0; --block)
+            {
+                cls.free_blocks.push_back(static_cast<std::uint32_t>(block - 1));
+            }
+            total += cls.block_size * cls.free_blocks.size();
+        }
+
+        memory_.reset(new char[total]);
+        stats_.reserved_bytes = total;
+    }
+
+    payload_slab(const payload_slab &) = delete;
+    payload_slab &operator=(const payload_slab &) = delete;
+
+    // smallest free block holding at least size bytes
+    payload_block allocate(std::size_t size)
+    {
+        payload_block block;
+        if (size == 0)
+        {
+            return block;
+        }
+
+        for (std::uint32_t i = 0; i < classes_n; ++i)
+        {
+            size_class &cls = classes_[i];
+            if (cls.block_size < size || cls.free_blocks.empty())
+            {
+                continue;
+            }
+
+            block.index_ = cls.free_blocks.back();
+            cls.free_blocks.pop_back();
+            block.size_class_ = i;
+            block.data_ = memory_.get() + cls.offset + block.index_ * cls.block_size;
+
+            stats_.in_use_bytes += cls.block_size;
+            if (stats_.in_use_bytes > stats_.peak_bytes)
+            {
+                stats_.peak_bytes = stats_.in_use_bytes;
+            }
+            return block;
+        }
+
+        ++stats_.heap_fallbacks;
+        block.heap_.reset(new char[size]);
+        block.data_ = block.heap_.get();
+        return block;
+    }
+
+    void release(payload_block &block)
+    {
+        if (block.size_class_ != payload_block::no_class)
+        {
+            size_class &cls = classes_[block.size_class_];
+            cls.free_blocks.push_back(block.index_);
+            stats_.in_use_bytes -= cls.block_size;
+        }
+        block = payload_block();
+    }
+
+    payload_slab_stats stats() const
+    {
+        return stats_;
+    }
+
+private:
+    struct size_class
+    {
+        std::size_t block_size = 0;
+        std::size_t offset = 0; // of the first block in memory_
+        std::vector<std::uint32_t> free_blocks;
+    };
+
+    std::unique_ptr<char[]> memory_;
+    size_class classes_[classes_n];
+    payload_slab_stats stats_;
+};
+
+} // namespace details
+} // namespace spdlog
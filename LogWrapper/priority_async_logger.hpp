@@ -0,0 +1,1012 @@
+#pragma once
+
+// Asynchronous logger backed by a level aware queue.
+//
+// Works like spdlog::async_logger with a single back thread, except that the
+// queue keeps one FIFO lane per level. In normal operation messages are
+// written oldest first, exactly like the stock thread pool. On shutdown the
+// pool can be drained against a deadline, in which case the most severe
+// messages are written first and whatever is left when the deadline passes
+// is abandoned instead of blocking the caller.
+//
+// Under pressure (slow disk) the pool sheds the least severe messages first:
+// a full queue evicts the oldest message of the lowest queued level, and
+// while the queue is more than 3/4 full only warnings and above are accepted
+// (unless the logger uses async_overflow_policy::block). Messages rejected
+// that way are only counted in atomics of the logger, without taking the
+// queue lock. Once the queue is back under 1/4, or at the latest a second
+// after the first drop, a summary line with the number of dropped messages
+// per level is written to each logger that lost messages.
+//
+// Message text is copied into a payload_slab owned by the pool rather than a
+// per message heap buffer. Blocks are taken and returned under their own
+// short lock, the copy itself runs without any lock held, and the back
+// thread returns written blocks in batches.
+
+#include <spdlog/logger.h>
+#include <spdlog/async_logger.h>
+#include <spdlog/details/log_msg.h>
+#include <spdlog/details/thread_pool.h>
+#include "tsc_clock.hpp"
+#include "hex_encode.hpp"
+#include "payload_slab.hpp"
+#include "log_site_registry.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace spdlog {
+
+class priority_async_logger;
+
+namespace details {
+
+using priority_async_logger_ptr = std::shared_ptr<spdlog::priority_async_logger>;
+
+// Async msg to move to/from the leveled queue. Once queued, logger_name,
+// payload and hex_data point into storage.
+struct priority_async_msg : log_msg
+{
+    async_msg_type msg_type{async_msg_type::log};
+    priority_async_logger_ptr worker_ptr;
+    std::uint64_t tsc = 0;     // if set, time is filled in by the back thread
+    std::uint32_t site_id = 0; // if set, source is filled in by the back thread
+
+    // WriteLogHex: payload holds the label, the raw bytes are hex encoded by
+    // the back thread
+    bool hex = false;
+    std::size_t hex_total_size = 0;
+    string_view_t hex_data;
+
+    payload_block storage;
+
+    priority_async_msg() = default;
+    priority_async_msg(const priority_async_msg &) = delete;
+    priority_async_msg &operator=(const priority_async_msg &) = delete;
+    priority_async_msg(priority_async_msg &&) = default;
+    priority_async_msg &operator=(priority_async_msg &&) = default;
+
+    priority_async_msg(priority_async_logger_ptr &&worker, async_msg_type the_type, const details::log_msg &m)
+        : log_msg{m}
+        , msg_type{the_type}
+        , worker_ptr{std::move(worker)}
+    {}
+
+    priority_async_msg(priority_async_logger_ptr &&worker, async_msg_type the_type)
+        : log_msg{}
+        , msg_type{the_type}
+        , worker_ptr{std::move(worker)}
+    {}
+};
+
+//
+// Bounded queue split into one FIFO lane per level, plus a control lane for
+// flush requests. All slots are allocated once in the constructor; lanes are
+// singly linked lists threaded through the slots, and every item carries a
+// sequence number so the oldest item overall can still be found in
+// O(lanes). Not thread safe - the owner must lock around it.
+//
+template<typename T>
+class leveled_q
+{
+public:
+    static const std::size_t control_lane = static_cast<std::size_t>(level::n_levels);
+    static const std::size_t lanes_n = control_lane + 1;
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    explicit leveled_q(std::size_t max_items)
+        : slots_(max_items)
+    {
+        for (std::size_t i = 0; i < slots_.size(); ++i)
+        {
+            slots_[i].next = i + 1 < slots_.size() ? i + 1 : npos;
+        }
+        free_head_ = slots_.empty() ? npos : 0;
+        for (std::size_t lane = 0; lane < lanes_n; ++lane)
+        {
+            heads_[lane] = npos;
+            tails_[lane] = npos;
+            counts_[lane] = 0;
+        }
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    bool full() const
+    {
+        return free_head_ == npos;
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    std::size_t size(std::size_t lane) const
+    {
+        return counts_[lane];
+    }
+
+    // caller must make sure the queue is not full
+    void push_back(T &&item, std::size_t lane)
+    {
+        std::size_t index = free_head_;
+        free_head_ = slots_[index].next;
+
+        slot &s = slots_[index];
+        s.item = std::move(item);
+        s.seq = next_seq_++;
+        s.next = npos;
+        if (tails_[lane] == npos)
+        {
+            heads_[lane] = index;
+        }
+        else
+        {
+            slots_[tails_[lane]].next = index;
+        }
+        tails_[lane] = index;
+        ++counts_[lane];
+        ++size_;
+    }
+
+    // pop the oldest item of the given lane
+    bool pop_front(std::size_t lane, T &popped_item)
+    {
+        std::size_t index = heads_[lane];
+        if (index == npos)
+        {
+            return false;
+        }
+
+        slot &s = slots_[index];
+        popped_item = std::move(s.item);
+        heads_[lane] = s.next;
+        if (heads_[lane] == npos)
+        {
+            tails_[lane] = npos;
+        }
+        s.next = free_head_;
+        free_head_ = index;
+        --counts_[lane];
+        --size_;
+        return true;
+    }
+
+    // pop the oldest item across all lanes (plain FIFO order)
+    bool pop_oldest(T &popped_item)
+    {
+        std::size_t oldest_lane = npos;
+        for (std::size_t lane = 0; lane < lanes_n; ++lane)
+        {
+            if (heads_[lane] != npos && (oldest_lane == npos || slots_[heads_[lane]].seq < slots_[heads_[oldest_lane]].seq))
+            {
+                oldest_lane = lane;
+            }
+        }
+        return oldest_lane != npos && pop_front(oldest_lane, popped_item);
+    }
+
+    // pop the oldest item of the most severe non empty level.
+    // the control lane is served last.
+    bool pop_most_severe(T &popped_item)
+    {
+        for (std::size_t lane = control_lane; lane > 0; --lane)
+        {
+            if (pop_front(lane - 1, popped_item))
+            {
+                return true;
+            }
+        }
+        return pop_front(control_lane, popped_item);
+    }
+
+    // lowest level lane holding a message, npos if there are only control messages
+    std::size_t lowest_level_lane() const
+    {
+        for (std::size_t lane = 0; lane < control_lane; ++lane)
+        {
+            if (heads_[lane] != npos)
+            {
+                return lane;
+            }
+        }
+        return npos;
+    }
+
+private:
+    struct slot
+    {
+        T item;
+        std::uint64_t seq = 0;
+        std::size_t next = npos;
+    };
+
+    std::vector<slot> slots_;
+    std::size_t free_head_ = npos;
+    std::size_t heads_[lanes_n];
+    std::size_t tails_[lanes_n];
+    std::size_t counts_[lanes_n];
+    std::size_t size_ = 0;
+    std::uint64_t next_seq_ = 0;
+};
+
+} // namespace details
+
+// Result of a deadline bounded drain
+struct drain_result
+{
+    std::size_t flushed = 0;   // log messages written to the sinks during the drain
+    std::size_t abandoned = 0; // log messages dropped because the deadline passed
+};
+
+class priority_thread_pool
+{
+public:
+    using item_type = details::priority_async_msg;
+    using q_type = details::leveled_q<item_type>;
+
+    explicit priority_thread_pool(std::size_t q_max_items);
+
+    // write everything still queued (oldest first) and join the back thread
+    ~priority_thread_pool();
+
+    priority_thread_pool(const priority_thread_pool &) = delete;
+    priority_thread_pool &operator=(const priority_thread_pool &) = delete;
+
+    void post_log(details::priority_async_logger_ptr &&worker_ptr, const details::log_msg &msg, async_overflow_policy overflow_policy,
+        std::uint64_t tsc = 0, std::uint32_t site_id = 0);
+    // msg payload is the label; data is copied once and encoded by the back thread
+    void post_hex(details::priority_async_logger_ptr &&worker_ptr, const details::log_msg &msg, const void *data, std::size_t size,
+        std::size_t total_size, async_overflow_policy overflow_policy, std::uint64_t tsc = 0);
+    void post_flush(details::priority_async_logger_ptr &&worker_ptr, async_overflow_policy overflow_policy);
+
+    // Stop accepting messages and write what is queued, most severe level
+    // first, until the deadline. Messages still queued at the deadline, and
+    // messages posted after the drain started, are abandoned.
+    // The deadline is checked between messages: a sink write (or rotation) in
+    // progress when it passes is finished before drain returns, so drain can
+    // return late by the time of one such write.
+    drain_result drain(std::chrono::steady_clock::time_point deadline);
+
+    std::size_t overrun_counter();
+    std::size_t queue_size();
+    details::payload_slab_stats payload_stats();
+
+    // calibrate the cycle counter so messages posted with a tsc get their time
+    // from the back thread. returns false if there is no invariant TSC.
+    bool enable_tsc();
+
+private:
+    // messages dropped for one logger since its last summary line
+    struct shed_report
+    {
+        details::priority_async_logger_ptr logger;
+        std::size_t dropped[level::n_levels];
+    };
+
+    void post_async_msg_(item_type &&new_msg, std::size_t lane, async_overflow_policy overflow_policy);
+    void store_payload_(item_type &msg);
+    void release_payload_(details::payload_block &block);
+    void release_payloads_(std::vector<details::payload_block> &blocks);
+    void reject_(const details::priority_async_logger_ptr &logger, level::level_enum lvl);
+    void fold_rejected_();
+    void record_drop_(const details::priority_async_logger_ptr &logger, std::size_t lane, std::size_t count = 1);
+    void update_backpressure_();
+    void write_shed_reports_(std::vector<shed_report> &reports, details::tsc_clock *clock);
+    void worker_loop_();
+    void stop_(bool drain_by_level, std::chrono::steady_clock::time_point deadline);
+
+    std::mutex q_mutex_;
+    std::condition_variable push_cv_;
+    std::condition_variable pop_cv_;
+    q_type q_;
+    std::mutex slab_mutex_; // nests inside q_mutex_, never the other way round
+    details::payload_slab payload_slab_;
+    std::size_t overrun_counter_ = 0;
+
+    // below this level messages are rejected before being copied
+    std::atomic<int> backpressure_level_{level::trace};
+    std::size_t high_watermark_;
+    std::size_t low_watermark_;
+    std::vector<shed_report> shed_reports_;
+    std::chrono::steady_clock::time_point first_shed_; // oldest drop in shed_reports_
+    std::vector<details::priority_async_logger_ptr> rejected_loggers_; // with counts not folded yet
+
+    // set once by enable_tsc, then only used by the back thread
+    std::unique_ptr<details::tsc_clock> tsc_clock_;
+
+    bool stopping_ = false;
+    bool drain_by_level_ = false;
+    std::chrono::steady_clock::time_point deadline_;
+    drain_result drain_result_;
+
+    std::thread worker_;
+};
+
+class priority_async_logger final : public std::enable_shared_from_this<priority_async_logger>, public logger
+{
+    friend class priority_thread_pool;
+
+public:
+    priority_async_logger(std::string logger_name, sink_ptr single_sink, std::weak_ptr<priority_thread_pool> tp,
+        async_overflow_policy overflow_policy = async_overflow_policy::block)
+        : logger(std::move(logger_name), std::move(single_sink))
+        , thread_pool_(std::move(tp))
+        , overflow_policy_(overflow_policy)
+    {
+        reset_rejected_();
+    }
+
+    priority_async_logger(const priority_async_logger &other)
+        : std::enable_shared_from_this<priority_async_logger>()
+        , logger(other)
+        , thread_pool_(other.thread_pool_)
+        , overflow_policy_(other.overflow_policy_)
+        , hex_limit_(other.hex_limit_.load())
+    {
+        reset_rejected_();
+    }
+
+    std::shared_ptr<logger> clone(std::string new_name) override
+    {
+        auto cloned = std::make_shared<priority_async_logger>(*this);
+        cloned->name_ = std::move(new_name);
+        return cloned;
+    }
+
+    // Log already formatted text, stamped with the cycle counter instead of
+    // the system clock. Needs priority_thread_pool::enable_tsc.
+    void log_tsc(level::level_enum lvl, string_view_t msg);
+
+    // Log already formatted text for a call site registered with
+    // log_site_registry. The back thread resolves the id to the source
+    // location; use_tsc works like log_tsc.
+    void log_site(level::level_enum lvl, std::uint32_t site_id, string_view_t msg, bool use_tsc);
+
+    // Log "<label> (<size> bytes): <hex>". The bytes are copied raw into the
+    // queue and hex encoded by the back thread, at most hex_limit of them.
+    // use_tsc works like log_tsc.
+    void log_hex(level::level_enum lvl, string_view_t label, const void *data, std::size_t size, bool use_tsc = false);
+
+    // max number of bytes log_hex keeps, 0 for no limit
+    void set_hex_limit(std::size_t max_bytes)
+    {
+        hex_limit_ = max_bytes;
+    }
+
+protected:
+    void sink_it_(const details::log_msg &msg) override;
+    void flush_() override;
+    void backend_sink_it_(const details::log_msg &msg);
+    void backend_flush_();
+
+private:
+    void reset_rejected_()
+    {
+        for (auto &count : rejected_)
+        {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    std::weak_ptr<priority_thread_pool> thread_pool_;
+    async_overflow_policy overflow_policy_;
+    std::atomic<std::size_t> hex_limit_{0};
+
+    // messages refused by the pool's backpressure gate, folded into the
+    // shed report by the back thread
+    std::atomic<std::size_t> rejected_[level::n_levels];
+    std::atomic<bool> rejected_pending_{false};
+};
+
+//
+// priority_thread_pool
+//
+inline priority_thread_pool::priority_thread_pool(std::size_t q_max_items)
+    : q_(q_max_items)
+    , payload_slab_(q_max_items)
+    , high_watermark_(q_max_items - q_max_items / 4)
+    , low_watermark_(q_max_items / 4)
+{
+    if (q_max_items == 0)
+    {
+        throw_spdlog_ex("priority_thread_pool: q_max_items arg cannot be zero");
+    }
+    worker_ = std::thread([this] { worker_loop_(); });
+}
+
+inline priority_thread_pool::~priority_thread_pool()
+{
+    SPDLOG_TRY
+    {
+        stop_(false, (std::chrono::steady_clock::time_point::max)());
+    }
+    SPDLOG_CATCH_STD
+}
+
+inline void priority_thread_pool::post_log(details::priority_async_logger_ptr &&worker_ptr, const details::log_msg &msg,
+    async_overflow_policy overflow_policy, std::uint64_t tsc, std::uint32_t site_id)
+{
+    if (overflow_policy != async_overflow_policy::block && static_cast<int>(msg.level) < backpressure_level_.load(std::memory_order_relaxed))
+    {
+        reject_(worker_ptr, msg.level);
+        return;
+    }
+
+    item_type async_m(std::move(worker_ptr), details::async_msg_type::log, msg);
+    async_m.tsc = tsc;
+    async_m.site_id = site_id;
+    post_async_msg_(std::move(async_m), static_cast<std::size_t>(msg.level), overflow_policy);
+}
+
+inline void priority_thread_pool::post_hex(details::priority_async_logger_ptr &&worker_ptr, const details::log_msg &msg, const void *data,
+    std::size_t size, std::size_t total_size, async_overflow_policy overflow_policy, std::uint64_t tsc)
+{
+    if (overflow_policy != async_overflow_policy::block && static_cast<int>(msg.level) < backpressure_level_.load(std::memory_order_relaxed))
+    {
+        reject_(worker_ptr, msg.level);
+        return;
+    }
+
+    item_type async_m(std::move(worker_ptr), details::async_msg_type::log, msg);
+    async_m.tsc = tsc;
+    async_m.hex = true;
+    async_m.hex_total_size = total_size;
+    async_m.hex_data = string_view_t(static_cast<const char *>(data), size);
+    post_async_msg_(std::move(async_m), static_cast<std::size_t>(msg.level), overflow_policy);
+}
+
+inline void priority_thread_pool::post_flush(details::priority_async_logger_ptr &&worker_ptr, async_overflow_policy overflow_policy)
+{
+    post_async_msg_(item_type(std::move(worker_ptr), details::async_msg_type::flush), q_type::control_lane, overflow_policy);
+}
+
+inline drain_result priority_thread_pool::drain(std::chrono::steady_clock::time_point deadline)
+{
+    stop_(true, deadline);
+    std::lock_guard<std::mutex> lock(q_mutex_);
+    return drain_result_;
+}
+
+inline std::size_t priority_thread_pool::overrun_counter()
+{
+    std::lock_guard<std::mutex> lock(q_mutex_);
+    return overrun_counter_;
+}
+
+inline std::size_t priority_thread_pool::queue_size()
+{
+    std::lock_guard<std::mutex> lock(q_mutex_);
+    return q_.size();
+}
+
+inline details::payload_slab_stats priority_thread_pool::payload_stats()
+{
+    std::lock_guard<std::mutex> lock(slab_mutex_);
+    return payload_slab_.stats();
+}
+
+inline bool priority_thread_pool::enable_tsc()
+{
+    if (!details::tsc_clock::supported())
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(q_mutex_);
+        if (tsc_clock_)
+        {
+            return true;
+        }
+    }
+
+    std::unique_ptr<details::tsc_clock> clock(new details::tsc_clock());
+    std::lock_guard<std::mutex> lock(q_mutex_);
+    if (!tsc_clock_)
+    {
+        tsc_clock_ = std::move(clock);
+    }
+    return true;
+}
+
+inline void priority_thread_pool::post_async_msg_(item_type &&new_msg, std::size_t lane, async_overflow_policy overflow_policy)
+{
+    store_payload_(new_msg);
+    {
+        std::unique_lock<std::mutex> lock(q_mutex_);
+        if (overflow_policy == async_overflow_policy::block)
+        {
+            pop_cv_.wait(lock, [this] { return stopping_ || !q_.full(); });
+        }
+
+        if (stopping_)
+        {
+            if (new_msg.msg_type == details::async_msg_type::log)
+            {
+                ++drain_result_.abandoned;
+            }
+            release_payload_(new_msg.storage);
+            return;
+        }
+
+        if (q_.full())
+        {
+            // a flush request never pushes out a log message; it is dropped
+            // and the next flush request covers what it would have flushed
+            if (new_msg.msg_type != details::async_msg_type::log)
+            {
+                release_payload_(new_msg.storage);
+                return;
+            }
+
+            // shed the least severe message, which may be the new one
+            std::size_t victim_lane = q_.lowest_level_lane();
+            if (victim_lane == q_type::npos || victim_lane > lane)
+            {
+                if (new_msg.msg_type == details::async_msg_type::log)
+                {
+                    record_drop_(new_msg.worker_ptr, lane);
+                }
+                release_payload_(new_msg.storage);
+                return;
+            }
+
+            item_type discarded;
+            q_.pop_front(victim_lane, discarded);
+            record_drop_(discarded.worker_ptr, victim_lane);
+            release_payload_(discarded.storage);
+        }
+        q_.push_back(std::move(new_msg), lane);
+        update_backpressure_();
+    }
+    push_cv_.notify_one();
+}
+
+// moves the text the message points to into a slab block. only taking the
+// block is locked, the copy runs unlocked so producers copy in parallel.
+inline void priority_thread_pool::store_payload_(item_type &msg)
+{
+    {
+        std::lock_guard<std::mutex> lock(slab_mutex_);
+        msg.storage = payload_slab_.allocate(msg.logger_name.size() + msg.payload.size() + msg.hex_data.size());
+    }
+    char *dest = msg.storage.data();
+    auto copy_view = [&dest](string_view_t view) {
+        string_view_t copied(dest, view.size());
+        if (view.size() > 0)
+        {
+            std::memcpy(dest, view.data(), view.size());
+            dest += view.size();
+        }
+        return copied;
+    };
+    msg.logger_name = copy_view(msg.logger_name);
+    msg.payload = copy_view(msg.payload);
+    msg.hex_data = copy_view(msg.hex_data);
+}
+
+inline void priority_thread_pool::release_payload_(details::payload_block &block)
+{
+    std::lock_guard<std::mutex> lock(slab_mutex_);
+    payload_slab_.release(block);
+}
+
+inline void priority_thread_pool::release_payloads_(std::vector<details::payload_block> &blocks)
+{
+    std::lock_guard<std::mutex> lock(slab_mutex_);
+    for (auto &block : blocks)
+    {
+        payload_slab_.release(block);
+    }
+    blocks.clear();
+}
+
+// counts a message refused by the backpressure gate. lock free unless this
+// is the logger's first refusal since the back thread last folded them.
+inline void priority_thread_pool::reject_(const details::priority_async_logger_ptr &logger, level::level_enum lvl)
+{
+    logger->rejected_[lvl].fetch_add(1, std::memory_order_relaxed);
+    if (!logger->rejected_pending_.exchange(true))
+    {
+        std::lock_guard<std::mutex> lock(q_mutex_);
+        rejected_loggers_.push_back(logger);
+    }
+}
+
+// must be called under q_mutex_. moves the counts of refused messages into
+// the shed reports.
+inline void priority_thread_pool::fold_rejected_()
+{
+    for (auto &logger : rejected_loggers_)
+    {
+        logger->rejected_pending_.store(false);
+        for (std::size_t lane = 0; lane < level::n_levels; ++lane)
+        {
+            std::size_t count = logger->rejected_[lane].exchange(0);
+            if (count > 0)
+            {
+                record_drop_(logger, lane, count);
+            }
+        }
+    }
+    rejected_loggers_.clear();
+}
+
+// must be called under q_mutex_
+inline void priority_thread_pool::record_drop_(const details::priority_async_logger_ptr &logger, std::size_t lane, std::size_t count)
+{
+    overrun_counter_ += count;
+    if (shed_reports_.empty())
+    {
+        first_shed_ = std::chrono::steady_clock::now();
+    }
+    for (auto &report : shed_reports_)
+    {
+        if (report.logger == logger)
+        {
+            report.dropped[lane] += count;
+            return;
+        }
+    }
+
+    shed_report report = {logger, {}};
+    report.dropped[lane] = count;
+    shed_reports_.push_back(std::move(report));
+}
+
+// must be called under q_mutex_
+inline void priority_thread_pool::update_backpressure_()
+{
+    std::size_t queued = q_.size();
+    if (stopping_)
+    {
+        // let every message reach post_async_msg_, which counts it as abandoned
+        backpressure_level_.store(level::trace, std::memory_order_relaxed);
+    }
+    else if (queued >= high_watermark_)
+    {
+        backpressure_level_.store(level::warn, std::memory_order_relaxed);
+    }
+    else if (queued <= low_watermark_)
+    {
+        backpressure_level_.store(level::trace, std::memory_order_relaxed);
+    }
+}
+
+// with the cycle counter enabled the lines are stamped through it too, so
+// they keep their place among messages converted by the back thread
+inline void priority_thread_pool::write_shed_reports_(std::vector<shed_report> &reports, details::tsc_clock *clock)
+{
+    for (auto &report : reports)
+    {
+        memory_buf_t buf;
+        fmt::format_to(std::back_inserter(buf), "queue full, dropped messages:");
+        for (int lvl = level::trace; lvl < level::off; ++lvl)
+        {
+            if (report.dropped[lvl] > 0)
+            {
+                string_view_t name = level::to_string_view(static_cast<level::level_enum>(lvl));
+                fmt::format_to(std::back_inserter(buf), " {}={}", fmt::string_view(name.data(), name.size()), report.dropped[lvl]);
+            }
+        }
+
+        log_clock::time_point time = clock ? clock->to_time_point(details::tsc_clock::ticks()) : log_clock::now();
+        details::log_msg msg(time, source_loc{}, report.logger->name(), level::warn, string_view_t(buf.data(), buf.size()));
+        report.logger->backend_sink_it_(msg);
+    }
+    reports.clear();
+}
+
+inline void priority_thread_pool::stop_(bool drain_by_level, std::chrono::steady_clock::time_point deadline)
+{
+    {
+        std::lock_guard<std::mutex> lock(q_mutex_);
+        if (stopping_)
+        {
+            return;
+        }
+        stopping_ = true;
+        drain_by_level_ = drain_by_level;
+        deadline_ = deadline;
+        update_backpressure_();
+    }
+    push_cv_.notify_one();
+    pop_cv_.notify_all();
+
+    if (worker_.joinable())
+    {
+        worker_.join();
+    }
+}
+
+inline void priority_thread_pool::worker_loop_()
+{
+    std::vector<details::priority_async_logger_ptr> drained_loggers;
+    std::vector<shed_report> shed_reports;
+    bool drain_by_level = false;
+    std::chrono::steady_clock::time_point deadline;
+    // blocks of written messages, handed back in batches
+    const std::size_t recycle_batch = 32;
+    std::vector<details::payload_block> written_storage;
+    written_storage.reserve(recycle_batch);
+    memory_buf_t hex_text;
+    for (;;)
+    {
+        item_type incoming_async_msg;
+        bool draining = false;
+        details::tsc_clock *clock = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(q_mutex_);
+            if (written_storage.size() >= recycle_batch || (q_.empty() && !written_storage.empty()))
+            {
+                release_payloads_(written_storage);
+            }
+            push_cv_.wait(lock, [this] { return stopping_ || !q_.empty(); });
+            if (q_.empty())
+            {
+                break;
+            }
+
+            draining = drain_by_level_;
+            if (draining)
+            {
+                if (std::chrono::steady_clock::now() >= deadline_)
+                {
+                    drain_result_.abandoned += q_.size() - q_.size(q_type::control_lane);
+                    item_type abandoned_msg;
+                    while (q_.pop_oldest(abandoned_msg))
+                    {
+                        release_payload_(abandoned_msg.storage);
+                    }
+                    break;
+                }
+                q_.pop_most_severe(incoming_async_msg);
+            }
+            else
+            {
+                q_.pop_oldest(incoming_async_msg);
+            }
+
+            clock = tsc_clock_.get();
+            update_backpressure_();
+            if (!rejected_loggers_.empty())
+            {
+                fold_rejected_();
+            }
+            if (!shed_reports_.empty() &&
+                (q_.size() <= low_watermark_ || std::chrono::steady_clock::now() - first_shed_ >= std::chrono::seconds(1)))
+            {
+                shed_reports.swap(shed_reports_);
+            }
+        }
+        pop_cv_.notify_one();
+
+        if (!shed_reports.empty())
+        {
+            write_shed_reports_(shed_reports, clock);
+        }
+
+        switch (incoming_async_msg.msg_type)
+        {
+        case details::async_msg_type::log:
+            if (incoming_async_msg.tsc != 0)
+            {
+                incoming_async_msg.time = clock ? clock->to_time_point(incoming_async_msg.tsc) : log_clock::now();
+            }
+            if (incoming_async_msg.site_id != 0)
+            {
+                if (auto *site = details::log_site_registry::instance().find(incoming_async_msg.site_id))
+                {
+                    incoming_async_msg.source = site->source();
+                }
+            }
+            if (incoming_async_msg.hex)
+            {
+                hex_text.clear();
+                details::format_hex_dump(incoming_async_msg.payload, incoming_async_msg.hex_data.data(), incoming_async_msg.hex_data.size(),
+                    incoming_async_msg.hex_total_size, hex_text);
+                details::log_msg hex_msg = incoming_async_msg;
+                hex_msg.payload = string_view_t(hex_text.data(), hex_text.size());
+                incoming_async_msg.worker_ptr->backend_sink_it_(hex_msg);
+            }
+            else
+            {
+                incoming_async_msg.worker_ptr->backend_sink_it_(incoming_async_msg);
+            }
+            if (draining)
+            {
+                ++drain_result_.flushed;
+                if (std::find(drained_loggers.begin(), drained_loggers.end(), incoming_async_msg.worker_ptr) == drained_loggers.end())
+                {
+                    drained_loggers.push_back(incoming_async_msg.worker_ptr);
+                }
+            }
+            break;
+        case details::async_msg_type::flush:
+            incoming_async_msg.worker_ptr->backend_flush_();
+            break;
+        default:
+            break;
+        }
+        written_storage.push_back(std::move(incoming_async_msg.storage));
+    }
+    release_payloads_(written_storage);
+
+    details::tsc_clock *clock = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(q_mutex_);
+        clock = tsc_clock_.get();
+        drain_by_level = drain_by_level_;
+        deadline = deadline_;
+        if (!drain_by_level || std::chrono::steady_clock::now() < deadline)
+        {
+            fold_rejected_();
+            shed_reports.swap(shed_reports_);
+        }
+    }
+    write_shed_reports_(shed_reports, clock);
+
+    // the most severe lanes were written first, so pending flush requests may
+    // not have been served yet - flush whatever the drain touched, as long as
+    // the deadline allows.
+    for (auto &logger : drained_loggers)
+    {
+        if (drain_by_level && std::chrono::steady_clock::now() >= deadline)
+        {
+            break;
+        }
+        logger->backend_flush_();
+    }
+}
+
+//
+// priority_async_logger
+//
+
+// send the log message to the thread pool
+inline void priority_async_logger::sink_it_(const details::log_msg &msg)
+{
+    if (auto pool_ptr = thread_pool_.lock())
+    {
+        pool_ptr->post_log(shared_from_this(), msg, overflow_policy_);
+    }
+    else
+    {
+        throw_spdlog_ex("async log: thread pool doesn't exist anymore");
+    }
+}
+
+inline void priority_async_logger::log_tsc(level::level_enum lvl, string_view_t msg)
+{
+    if (!should_log(lvl))
+    {
+        return;
+    }
+
+    SPDLOG_TRY
+    {
+        std::uint64_t tsc = details::tsc_clock::ticks();
+        details::log_msg tsc_msg(log_clock::time_point(), source_loc{}, name_, lvl, msg);
+        if (auto pool_ptr = thread_pool_.lock())
+        {
+            pool_ptr->post_log(shared_from_this(), tsc_msg, overflow_policy_, tsc);
+        }
+        else
+        {
+            throw_spdlog_ex("async log: thread pool doesn't exist anymore");
+        }
+    }
+    SPDLOG_LOGGER_CATCH(source_loc())
+}
+
+inline void priority_async_logger::log_site(level::level_enum lvl, std::uint32_t site_id, string_view_t msg, bool use_tsc)
+{
+    if (!should_log(lvl))
+    {
+        return;
+    }
+
+    SPDLOG_TRY
+    {
+        std::uint64_t tsc = use_tsc ? details::tsc_clock::ticks() : 0;
+        details::log_msg site_msg(tsc != 0 ? log_clock::time_point() : log_clock::now(), source_loc{}, name_, lvl, msg);
+        if (auto pool_ptr = thread_pool_.lock())
+        {
+            pool_ptr->post_log(shared_from_this(), site_msg, overflow_policy_, tsc, site_id);
+        }
+        else
+        {
+            throw_spdlog_ex("async log: thread pool doesn't exist anymore");
+        }
+    }
+    SPDLOG_LOGGER_CATCH(source_loc())
+}
+
+inline void priority_async_logger::log_hex(level::level_enum lvl, string_view_t label, const void *data, std::size_t size, bool use_tsc)
+{
+    if (!should_log(lvl))
+    {
+        return;
+    }
+
+    SPDLOG_TRY
+    {
+        std::size_t limit = hex_limit_.load(std::memory_order_relaxed);
+        std::size_t kept = limit != 0 && size > limit ? limit : size;
+        std::uint64_t tsc = use_tsc ? details::tsc_clock::ticks() : 0;
+        details::log_msg label_msg(tsc != 0 ? log_clock::time_point() : log_clock::now(), source_loc{}, name_, lvl, label);
+        if (auto pool_ptr = thread_pool_.lock())
+        {
+            pool_ptr->post_hex(shared_from_this(), label_msg, data, kept, size, overflow_policy_, tsc);
+        }
+        else
+        {
+            throw_spdlog_ex("async log: thread pool doesn't exist anymore");
+        }
+    }
+    SPDLOG_LOGGER_CATCH(source_loc())
+}
+
+// send flush request to the thread pool
+inline void priority_async_logger::flush_()
+{
+    if (auto pool_ptr = thread_pool_.lock())
+    {
+        pool_ptr->post_flush(shared_from_this(), overflow_policy_);
+    }
+    else
+    {
+        throw_spdlog_ex("async flush: thread pool doesn't exist anymore");
+    }
+}
+
+//
+// backend functions - called from the thread pool to do the actual job
+//
+inline void priority_async_logger::backend_sink_it_(const details::log_msg &msg)
+{
+    for (auto &sink : sinks_)
+    {
+        if (sink->should_log(msg.level))
+        {
+            SPDLOG_TRY
+            {
+                sink->log(msg);
+            }
+            SPDLOG_LOGGER_CATCH(msg.source)
+        }
+    }
+
+    if (should_flush_(msg))
+    {
+        backend_flush_();
+    }
+}
+
+inline void priority_async_logger::backend_flush_()
+{
+    for (auto &sink : sinks_)
+    {
+        SPDLOG_TRY
+        {
+            sink->flush();
+        }
+        SPDLOG_LOGGER_CATCH(source_loc())
+    }
+}
+
+} // namespace spdlog
@@ -0,0 +1,464 @@
+#pragma once
+
+// Shared memory transport between logging processes and the local collector.
+//
+// The collector (LogCollector.exe) creates a fixed set of named rings at
+// startup. Each logging process claims one free ring and writes raw records
+// into it - logger name, level, time, thread id and the already formatted
+// payload - so the per message cost in the worker process is a memcpy. The
+// collector drains all rings into shared compressed_rotating_file_sink
+// outputs, one per log file.
+//
+// A named mutex keeps a second collector from starting. A restarted
+// collector attaches to the rings the workers still hold and bumps the
+// collector epoch in each; the worker sinks then send their open_logger
+// records again, since the new collector never saw the earlier ones.
+//
+// A ring is single producer (records are written under a process local
+// mutex) and single consumer (the collector). Read and write positions are
+// monotonic byte counters kept in the mapping itself.
+
+#include <spdlog/sinks/base_sink.h>
+#include <spdlog/details/null_mutex.h>
+
+#include <windows.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace spdlog {
+namespace details {
+
+static const std::size_t shm_ring_count = 16;
+static const std::uint32_t shm_ring_default_capacity = 4 * 1024 * 1024;
+
+// Layout at the start of every ring mapping, followed by the data area.
+struct shm_ring_header
+{
+    std::atomic<std::uint32_t> owner_pid;   // 0 = free
+    std::uint32_t capacity;                 // size of the data area, power of two
+    std::atomic<std::uint64_t> write_pos;   // owned by the producer
+    std::atomic<std::uint64_t> read_pos;    // owned by the collector
+    std::atomic<std::uint64_t> dropped;     // records rejected because the ring was full
+    std::atomic<std::uint32_t> collector_epoch; // bumped by every collector attaching to the ring
+    std::atomic<std::uint64_t> reported_dropped; // part of dropped the collectors have logged
+};
+
+static const std::size_t shm_ring_data_offset = 64;
+static_assert(sizeof(shm_ring_header) <= shm_ring_data_offset, "shm_ring_header too big");
+
+enum class shm_record_type : std::uint16_t
+{
+    padding,     // fills the end of the data area when a record would wrap
+    open_logger, // payload is the log file name (filename_t characters), thread_id the owner pid
+    log
+};
+
+// Every record starts 8 byte aligned. A padding record only uses the first
+// 8 bytes of the header.
+struct shm_record_header
+{
+    std::uint32_t size;         // whole record including this header and alignment
+    shm_record_type type;
+    std::uint16_t level;
+    std::uint32_t payload_size; // bytes of payload following the logger name
+    std::uint16_t name_size;    // bytes of logger name following this header
+    std::uint16_t reserved;
+    std::int64_t time;          // nanoseconds since epoch
+    std::uint64_t thread_id;
+};
+
+// Held by the collector while it runs. A collector that crashed leaves the
+// mutex abandoned, the next one takes it over.
+class shm_collector_lock
+{
+public:
+    shm_collector_lock()
+    {
+        mutex_ = ::CreateMutexW(nullptr, FALSE, L"Local\\LogWrapperCollector");
+        if (mutex_ == nullptr)
+        {
+            throw_spdlog_ex("shm_collector_lock: CreateMutex failed", static_cast<int>(::GetLastError()));
+        }
+
+        DWORD result = ::WaitForSingleObject(mutex_, 0);
+        if (result != WAIT_OBJECT_0 && result != WAIT_ABANDONED)
+        {
+            ::CloseHandle(mutex_);
+            throw_spdlog_ex("shm_collector_lock: another collector is running");
+        }
+    }
+
+    ~shm_collector_lock()
+    {
+        ::ReleaseMutex(mutex_);
+        ::CloseHandle(mutex_);
+    }
+
+    shm_collector_lock(const shm_collector_lock &) = delete;
+    shm_collector_lock &operator=(const shm_collector_lock &) = delete;
+
+private:
+    HANDLE mutex_ = nullptr;
+};
+
+class shm_ring
+{
+public:
+    ~shm_ring()
+    {
+        if (header_ && producer_)
+        {
+            // unread records stay in the ring, the collector drains them
+            // before the ring can be claimed again.
+            header_->owner_pid.store(0, std::memory_order_release);
+        }
+        if (header_)
+        {
+            ::UnmapViewOfFile(header_);
+        }
+        if (mapping_)
+        {
+            ::CloseHandle(mapping_);
+        }
+    }
+
+    shm_ring(const shm_ring &) = delete;
+    shm_ring &operator=(const shm_ring &) = delete;
+
+    static std::wstring name(std::size_t index)
+    {
+        return L"Local\\LogWrapperRing_" + std::to_wstring(index);
+    }
+
+    // collector side: create the ring with the given index, or attach to it
+    // if workers still hold it from a previous collector. Hold a
+    // shm_collector_lock while using the rings.
+    static std::unique_ptr<shm_ring> create(std::size_t index, std::uint32_t capacity = shm_ring_default_capacity)
+    {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+        {
+            throw_spdlog_ex("shm_ring: capacity must be a power of two");
+        }
+
+        DWORD mapping_size = static_cast<DWORD>(shm_ring_data_offset + capacity);
+        HANDLE mapping = ::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, mapping_size, name(index).c_str());
+        if (mapping == nullptr)
+        {
+            throw_spdlog_ex("shm_ring: CreateFileMapping failed", static_cast<int>(::GetLastError()));
+        }
+        bool existing = ::GetLastError() == ERROR_ALREADY_EXISTS;
+
+        std::unique_ptr<shm_ring> ring(new shm_ring(mapping, false));
+        if (!ring->header_)
+        {
+            throw_spdlog_ex("shm_ring: MapViewOfFile failed", static_cast<int>(::GetLastError()));
+        }
+
+        // a fresh mapping is zero filled. an existing one keeps its positions
+        // and the records a previous collector left unread.
+        if (existing && ring->header_->capacity != 0 && ring->header_->capacity != capacity)
+        {
+            throw_spdlog_ex("shm_ring: existing ring has a different capacity");
+        }
+        ring->header_->capacity = capacity;
+        ring->capacity_ = capacity;
+        ring->header_->collector_epoch.fetch_add(1, std::memory_order_acq_rel);
+        return ring;
+    }
+
+    // producer side: claim the first free ring for this process.
+    // returns null when no collector is running or all rings are in use.
+    static std::unique_ptr<shm_ring> claim()
+    {
+        std::uint32_t pid = static_cast<std::uint32_t>(::GetCurrentProcessId());
+        for (std::size_t index = 0; index < shm_ring_count; ++index)
+        {
+            HANDLE mapping = ::OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name(index).c_str());
+            if (mapping == nullptr)
+            {
+                continue;
+            }
+
+            std::unique_ptr<shm_ring> ring(new shm_ring(mapping, true));
+            if (!ring->header_)
+            {
+                continue;
+            }
+
+            shm_ring_header *header = ring->header_;
+            std::uint32_t free_pid = 0;
+            if (header->read_pos.load() == header->write_pos.load() && header->owner_pid.compare_exchange_strong(free_pid, pid))
+            {
+                return ring;
+            }
+            ring->producer_ = false; // not ours, do not release it
+        }
+        return nullptr;
+    }
+
+    shm_ring_header *header()
+    {
+        return header_;
+    }
+
+    // producer side. returns false if the ring is full, counting a drop for
+    // log records.
+    bool write(shm_record_type type, level::level_enum lvl, log_clock::time_point time, std::size_t thread_id, string_view_t logger_name,
+        const void *payload, std::size_t payload_size)
+    {
+        std::size_t name_size = logger_name.size() < 0xffff ? logger_name.size() : 0xffff;
+        std::size_t record_size = align_(sizeof(shm_record_header) + name_size + payload_size);
+        std::uint32_t capacity = header_->capacity;
+
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        std::uint64_t write_pos = header_->write_pos.load(std::memory_order_relaxed);
+        std::uint64_t read_pos = header_->read_pos.load(std::memory_order_acquire);
+        std::size_t offset = static_cast<std::size_t>(write_pos & (capacity - 1));
+        std::size_t tail = capacity - offset;
+        std::size_t needed = record_size + (tail < record_size ? tail : 0);
+        if (record_size > capacity / 2 || write_pos - read_pos + needed > capacity)
+        {
+            if (type == shm_record_type::log)
+            {
+                count_drop();
+            }
+            return false;
+        }
+
+        if (tail < record_size)
+        {
+            shm_record_header *padding = reinterpret_cast<shm_record_header *>(data_ + offset);
+            padding->size = static_cast<std::uint32_t>(tail);
+            padding->type = shm_record_type::padding;
+            write_pos += tail;
+            offset = 0;
+        }
+
+        shm_record_header *record = reinterpret_cast<shm_record_header *>(data_ + offset);
+        record->size = static_cast<std::uint32_t>(record_size);
+        record->type = type;
+        record->level = static_cast<std::uint16_t>(lvl);
+        record->payload_size = static_cast<std::uint32_t>(payload_size);
+        record->name_size = static_cast<std::uint16_t>(name_size);
+        record->reserved = 0;
+        record->time = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+        record->thread_id = thread_id;
+
+        char *dest = data_ + offset + sizeof(shm_record_header);
+        std::memcpy(dest, logger_name.data(), name_size);
+        if (payload_size > 0)
+        {
+            std::memcpy(dest + name_size, payload, payload_size);
+        }
+
+        header_->write_pos.store(write_pos + record_size, std::memory_order_release);
+        return true;
+    }
+
+    std::uint32_t collector_epoch() const
+    {
+        return header_->collector_epoch.load(std::memory_order_acquire);
+    }
+
+    // producer side, for a record that was given up before reaching write
+    void count_drop()
+    {
+        header_->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // collector side. calls fun(const shm_record_header &, string_view_t logger_name, string_view_t payload)
+    // for every record available and returns how many were read.
+    //
+    // Any process in the session can write the mapping, so every record is
+    // checked against the ring bounds before it is used. At the first
+    // malformed record the rest of the available data is skipped and added
+    // to skipped_bytes().
+    template<typename Fn>
+    std::size_t read_all(Fn &&fun)
+    {
+        std::uint64_t read_pos = header_->read_pos.load(std::memory_order_relaxed);
+        std::uint64_t write_pos = header_->write_pos.load(std::memory_order_acquire);
+        std::size_t records = 0;
+
+        // also catches a write_pos behind read_pos
+        if (write_pos - read_pos > capacity_)
+        {
+            skipped_bytes_ += write_pos - read_pos;
+            header_->read_pos.store(write_pos, std::memory_order_release);
+            return 0;
+        }
+
+        while (read_pos < write_pos)
+        {
+            std::size_t offset = static_cast<std::size_t>(read_pos & (capacity_ - 1));
+            std::uint64_t available = write_pos - read_pos;
+
+            // copy the header, the producer side could change it while we look at it.
+            // a padding record is only guaranteed its first 8 bytes.
+            shm_record_header record{};
+            std::memcpy(&record, data_ + offset, min_record_size);
+            if (!check_size_(record.size, offset, available))
+            {
+                skipped_bytes_ += available;
+                read_pos = write_pos;
+                break;
+            }
+
+            if (record.type != shm_record_type::padding)
+            {
+                if (record.size < sizeof(shm_record_header))
+                {
+                    skipped_bytes_ += available;
+                    read_pos = write_pos;
+                    break;
+                }
+                std::memcpy(&record, data_ + offset, sizeof(shm_record_header));
+                if (!check_record_(record))
+                {
+                    skipped_bytes_ += available;
+                    read_pos = write_pos;
+                    break;
+                }
+
+                const char *name = data_ + offset + sizeof(shm_record_header);
+                fun(record, string_view_t(name, record.name_size), string_view_t(name + record.name_size, record.payload_size));
+                ++records;
+            }
+            read_pos += record.size;
+        }
+
+        header_->read_pos.store(read_pos, std::memory_order_release);
+        return records;
+    }
+
+    // collector side, bytes thrown away by read_all because they did not form valid records
+    std::uint64_t skipped_bytes() const
+    {
+        return skipped_bytes_;
+    }
+
+private:
+    shm_ring(HANDLE mapping, bool producer)
+        : mapping_(mapping)
+        , producer_(producer)
+    {
+        header_ = static_cast<shm_ring_header *>(::MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+        data_ = header_ ? reinterpret_cast<char *>(header_) + shm_ring_data_offset : nullptr;
+    }
+
+    static std::size_t align_(std::size_t size)
+    {
+        return (size + 7) & ~static_cast<std::size_t>(7);
+    }
+
+    static const std::uint32_t min_record_size = 8;
+
+    // aligned, not empty and within both the available data and the data area
+    bool check_size_(std::uint32_t size, std::size_t offset, std::uint64_t available) const
+    {
+        return size >= min_record_size && size % min_record_size == 0 && size <= available && offset + size <= capacity_;
+    }
+
+    // a known type, and the name and payload fit into the record
+    static bool check_record_(const shm_record_header &record)
+    {
+        if (record.type != shm_record_type::open_logger && record.type != shm_record_type::log)
+        {
+            return false;
+        }
+        std::uint64_t used = static_cast<std::uint64_t>(sizeof(shm_record_header)) + record.name_size + record.payload_size;
+        return used <= record.size;
+    }
+
+    HANDLE mapping_ = nullptr;
+    shm_ring_header *header_ = nullptr;
+    char *data_ = nullptr;
+    std::uint32_t capacity_ = 0; // the collector's own copy, not read back from the mapping
+    std::uint64_t skipped_bytes_ = 0;
+    bool producer_ = false;
+    std::mutex write_mutex_;
+};
+
+} // namespace details
+
+namespace sinks {
+
+//
+// Sink writing raw records into a shared memory ring drained by the collector.
+// Formatting and file output happen in the collector, the formatter of this
+// sink is not used.
+//
+// The collector discards records of loggers it got no open_logger record
+// for. If the ring is full when the sink is created, the open is retried
+// before every log record; records that cannot be preceded by it are
+// counted as dropped. The open is sent again when a restarted collector
+// attaches to the ring.
+//
+template<typename Mutex>
+class shm_ring_sink final : public base_sink<Mutex>
+{
+public:
+    shm_ring_sink(std::shared_ptr<details::shm_ring> ring, const std::string &logger_name, filename_t filename)
+        : ring_(std::move(ring))
+        , filename_(std::move(filename))
+    {
+        open_pending_ = !send_open_(logger_name);
+    }
+
+    filename_t filename()
+    {
+        return filename_;
+    }
+
+protected:
+    void sink_it_(const details::log_msg &msg) override
+    {
+        // the logger calls in from many threads at once, the null_mutex
+        // sink does not serialize them
+        if (open_pending_.load(std::memory_order_acquire) || open_epoch_.load(std::memory_order_relaxed) != ring_->collector_epoch())
+        {
+            if (!send_open_(msg.logger_name))
+            {
+                ring_->count_drop();
+                return;
+            }
+            open_pending_.store(false, std::memory_order_release);
+        }
+        ring_->write(details::shm_record_type::log, msg.level, msg.time, msg.thread_id, msg.logger_name, msg.payload.data(), msg.payload.size());
+    }
+
+    void flush_() override {}
+
+private:
+    // tell the collector where this logger writes to
+    bool send_open_(string_view_t logger_name)
+    {
+        // read before writing: a collector attaching in between gets the open
+        // anyway, it is only sent once more
+        std::uint32_t epoch = ring_->collector_epoch();
+        if (!ring_->write(details::shm_record_type::open_logger, level::off, log_clock::now(), ::GetCurrentProcessId(), logger_name,
+                filename_.data(), filename_.size() * sizeof(filename_t::value_type)))
+        {
+            return false;
+        }
+        open_epoch_.store(epoch, std::memory_order_relaxed);
+        return true;
+    }
+
+    std::shared_ptr<details::shm_ring> ring_;
+    filename_t filename_;
+    std::atomic<bool> open_pending_{false};
+    std::atomic<std::uint32_t> open_epoch_{0}; // collector epoch the last open was sent under
+};
+
+using shm_ring_sink_mt = shm_ring_sink<std::mutex>;
+using shm_ring_sink_st = shm_ring_sink<details::null_mutex>;
+
+} // namespace sinks
+} // namespace spdlog
@@ -0,0 +1,134 @@
+#pragma once
+
+// Cycle counter timestamps.
+//
+// The producer thread only reads the time stamp counter; the backend thread
+// converts the raw value to wall clock time. The tick rate is measured
+// against the steady clock over the whole time since construction, so it gets
+// more precise the longer the clock runs; the wall clock anchor is refreshed
+// after 100ms, then at doubling intervals up to once a second, so the rough
+// rate of the first 10ms is replaced quickly.
+// Requires an invariant TSC (constant rate, synchronized across cores).
+
+#include <spdlog/common.h>
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define LOGWRAPPER_HAS_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define LOGWRAPPER_HAS_TSC
+#endif
+
+namespace spdlog {
+namespace details {
+
+class tsc_clock
+{
+public:
+    // blocks for the initial calibration window
+    tsc_clock()
+    {
+        start_tsc_ = ticks();
+        start_steady_ = std::chrono::steady_clock::now();
+        base_tsc_ = start_tsc_;
+        base_time_ = log_clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        rebase_();
+    }
+
+    static bool supported()
+    {
+#if defined(LOGWRAPPER_HAS_TSC)
+        unsigned int regs[4] = {0, 0, 0, 0};
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0x80000000);
+        if (static_cast<unsigned int>(info[0]) < 0x80000007u)
+        {
+            return false;
+        }
+        __cpuid(info, 0x80000007);
+        regs[3] = static_cast<unsigned int>(info[3]);
+#else
+        if (__get_cpuid_max(0x80000000u, nullptr) < 0x80000007u)
+        {
+            return false;
+        }
+        __get_cpuid(0x80000007u, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+        // EDX bit 8: invariant TSC
+        return (regs[3] & (1u << 8)) != 0;
+#else
+        return false;
+#endif
+    }
+
+    static std::uint64_t ticks()
+    {
+#if defined(LOGWRAPPER_HAS_TSC)
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+    // backend thread only
+    log_clock::time_point to_time_point(std::uint64_t tsc)
+    {
+        if (tsc - base_tsc_ >= recalibrate_ticks_ && static_cast<std::int64_t>(tsc - base_tsc_) > 0)
+        {
+            rebase_();
+        }
+
+        double ns = static_cast<double>(static_cast<std::int64_t>(tsc - base_tsc_)) * ns_per_tick_;
+        log_clock::time_point time = base_time_ + std::chrono::duration_cast<log_clock::duration>(std::chrono::nanoseconds(static_cast<std::int64_t>(ns)));
+
+        // a recalibration must not make consecutive records go back in time
+        if (time < last_time_)
+        {
+            time = last_time_;
+        }
+        last_time_ = time;
+        return time;
+    }
+
+private:
+    // measure the tick rate since construction and start a new window
+    void rebase_()
+    {
+        std::uint64_t now_tsc = ticks();
+        std::chrono::steady_clock::time_point now_steady = std::chrono::steady_clock::now();
+        log_clock::time_point now_time = log_clock::now();
+
+        std::int64_t elapsed_ticks = static_cast<std::int64_t>(now_tsc - start_tsc_);
+        std::int64_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now_steady - start_steady_).count();
+        if (elapsed_ticks > 0 && elapsed_ns > 0)
+        {
+            ns_per_tick_ = static_cast<double>(elapsed_ns) / static_cast<double>(elapsed_ticks);
+            recalibrate_ticks_ = static_cast<std::uint64_t>(static_cast<double>(recalibrate_ns_) / ns_per_tick_);
+            recalibrate_ns_ = recalibrate_ns_ * 2 < max_recalibrate_ns ? recalibrate_ns_ * 2 : max_recalibrate_ns;
+        }
+        base_tsc_ = now_tsc;
+        base_time_ = now_time;
+    }
+
+    static const std::int64_t max_recalibrate_ns = 1000000000;
+
+    std::uint64_t start_tsc_ = 0;
+    std::chrono::steady_clock::time_point start_steady_;
+    std::int64_t recalibrate_ns_ = 100000000;
+    std::uint64_t base_tsc_ = 0;
+    log_clock::time_point base_time_;
+    log_clock::time_point last_time_;
+    double ns_per_tick_ = 1.0;
+    std::uint64_t recalibrate_ticks_ = 1000000000;
+};
+
+} // namespace details
+} // namespace spdlog
@@ -0,0 +1,223 @@
+#pragma once
+
+// wchar_t -> UTF-8 transcoding for the WriteLogW path.
+//
+// Runs of ASCII are converted 16 (AVX2) or 8 (SSE2) code units at a time;
+// everything else goes through a scalar encoder that re-enters the vector
+// loop as soon as the input is ASCII again. wchar_t is treated as UTF-16 when
+// it is 2 bytes wide (Windows) and as UTF-32 otherwise. Invalid code units
+// (lone surrogates, values above U+10FFFF) become U+FFFD, as with
+// WideCharToMultiByte.
+
+#include <spdlog/common.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define LOGWRAPPER_UTF8_SSE2
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#define LOGWRAPPER_UTF8_AVX2
+#define LOGWRAPPER_TARGET_AVX2
+#elif defined(__GNUC__)
+#include <immintrin.h>
+#define LOGWRAPPER_UTF8_AVX2
+#define LOGWRAPPER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace spdlog {
+namespace details {
+namespace utf8 {
+
+#if defined(LOGWRAPPER_UTF8_AVX2)
+inline bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+    static const bool has_avx2 = [] {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+        {
+            return false;
+        }
+        __cpuid(info, 1);
+        bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        return os_saves_ymm && (info[1] & (1 << 5)) != 0;
+    }();
+    return has_avx2;
+#else
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") != 0;
+    return has_avx2;
+#endif
+}
+
+// 16 UTF-16 code units per step
+LOGWRAPPER_TARGET_AVX2 inline std::size_t ascii_run_avx2(const std::uint16_t *src, std::size_t size, char *out)
+{
+    const __m256i non_ascii = _mm256_set1_epi16(static_cast<short>(0xff80));
+    std::size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m256i units = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        if (!_mm256_testz_si256(units, non_ascii))
+        {
+            break;
+        }
+        // packus works per 128 bit lane, gather both halves into the low lane
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(units, units), 0xd8);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm256_castsi256_si128(packed));
+    }
+    return i;
+}
+#endif
+
+// length of the leading ASCII run, which is written to out
+inline std::size_t ascii_run(const std::uint16_t *src, std::size_t size, char *out)
+{
+    std::size_t i = 0;
+#if defined(LOGWRAPPER_UTF8_AVX2)
+    if (size >= 16 && cpu_has_avx2())
+    {
+        i = ascii_run_avx2(src, size, out);
+    }
+#endif
+#if defined(LOGWRAPPER_UTF8_SSE2)
+    const __m128i non_ascii = _mm_set1_epi16(static_cast<short>(0xff80));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= size; i += 8)
+    {
+        __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, non_ascii), zero)) != 0xffff)
+        {
+            break;
+        }
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(units, units));
+    }
+#endif
+    for (; i < size && src[i] < 0x80; ++i)
+    {
+        out[i] = static_cast<char>(src[i]);
+    }
+    return i;
+}
+
+inline std::size_t ascii_run(const std::uint32_t *src, std::size_t size, char *out)
+{
+    std::size_t i = 0;
+#if defined(LOGWRAPPER_UTF8_SSE2)
+    const __m128i non_ascii = _mm_set1_epi32(static_cast<int>(0xffffff80));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= size; i += 4)
+    {
+        __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(units, non_ascii), zero)) != 0xffff)
+        {
+            break;
+        }
+        __m128i words = _mm_packs_epi32(units, units);
+        int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        std::memcpy(out + i, &bytes, 4);
+    }
+#endif
+    for (; i < size && src[i] < 0x80; ++i)
+    {
+        out[i] = static_cast<char>(src[i]);
+    }
+    return i;
+}
+
+inline char *encode(std::uint32_t cp, char *out)
+{
+    if (cp < 0x80)
+    {
+        *out++ = static_cast<char>(cp);
+    }
+    else if (cp < 0x800)
+    {
+        *out++ = static_cast<char>(0xc0 | (cp >> 6));
+        *out++ = static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    else if (cp < 0x10000)
+    {
+        *out++ = static_cast<char>(0xe0 | (cp >> 12));
+        *out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    else
+    {
+        *out++ = static_cast<char>(0xf0 | (cp >> 18));
+        *out++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        *out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    return out;
+}
+
+// decode one non ASCII code point starting at src[i], advances i
+inline std::uint32_t next_code_point(const std::uint16_t *src, std::size_t size, std::size_t &i)
+{
+    std::uint32_t unit = src[i++];
+    if (unit < 0xd800 || unit > 0xdfff)
+    {
+        return unit;
+    }
+    if (unit <= 0xdbff && i < size && src[i] >= 0xdc00 && src[i] <= 0xdfff)
+    {
+        std::uint32_t low = src[i++];
+        return 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+    }
+    return 0xfffd;
+}
+
+inline std::uint32_t next_code_point(const std::uint32_t *src, std::size_t, std::size_t &i)
+{
+    std::uint32_t unit = src[i++];
+    if ((unit >= 0xd800 && unit <= 0xdfff) || unit > 0x10ffff)
+    {
+        return 0xfffd;
+    }
+    return unit;
+}
+
+template<typename Unit>
+void transcode(const Unit *src, std::size_t size, memory_buf_t &dest)
+{
+    // worst case: a UTF-16 unit becomes 3 bytes (a surrogate pair 4), a UTF-32 unit 4
+    const std::size_t max_bytes_per_unit = sizeof(Unit) == 2 ? 3 : 4;
+    std::size_t old_size = dest.size();
+    dest.resize(old_size + size * max_bytes_per_unit);
+    char *begin = dest.data() + old_size;
+    char *out = begin;
+
+    std::size_t i = 0;
+    while (i < size)
+    {
+        std::size_t run = ascii_run(src + i, size - i, out);
+        i += run;
+        out += run;
+        while (i < size && src[i] >= 0x80)
+        {
+            out = encode(next_code_point(src, size, i), out);
+        }
+    }
+    dest.resize(old_size + static_cast<std::size_t>(out - begin));
+}
+
+} // namespace utf8
+
+// append the UTF-8 encoding of a wide string to dest
+inline void wstr_to_utf8(const wchar_t *src, std::size_t size, memory_buf_t &dest)
+{
+    typedef std::conditional<sizeof(wchar_t) == 2, std::uint16_t, std::uint32_t>::type unit_type;
+    utf8::transcode(reinterpret_cast<const unit_type *>(src), size, dest);
+}
+
+} // namespace details
+} // namespace spdlog